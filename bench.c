@@ -0,0 +1,376 @@
+/*
+ * Benchmark the configuration loader.
+ *
+ * A synthetic configuration is generated with the number of keys, nesting,
+ * value size, mix of quoted and multi-line values and density of comments
+ * that are given on the command line. Then the scanner, the parser, table
+ * lookups and the command line parser are timed. The results are printed
+ * as a JSON object so that runs can be compared across commits.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include "config.h"
+#include "cmdline.h"
+#include "scan_file.h"
+#include "parse_file.h"
+#include "memory.h"
+#include "trace.h"
+
+typedef struct {
+    long keys;          // number of values in the file
+    long depth;         // deepest nesting of sections
+    long value_size;    // average length of a value
+    long quoted;        // percent of values that are quoted
+    long multiline;     // percent of quoted values that span lines
+    long comments;      // percent of values that have a comment line
+    long runs;          // best of this many runs is reported
+    long lookups;       // number of table lookups to time
+    long args;          // number of command line arguments to parse
+    long seed;
+    int utf8;           // check the file when it is parsed
+    const char* output; // keep the generated file here
+    const char* trace;  // save the trace events here
+} bench_params_t;
+
+static const cmdline_entry_t bench_options[] = {
+    { 'k', "keys", "keys", "number of keys to generate", "100000", NULL, CMD_NUM|CMD_ARGS, NULL },
+    { 'd', "depth", "depth", "deepest nesting of sections", "3", NULL, CMD_NUM|CMD_ARGS, NULL },
+    { 's', "value-size", "value_size", "average size of a value", "16", NULL, CMD_NUM|CMD_ARGS, NULL },
+    { 'q', "quoted", "quoted", "percent of values that are quoted", "20", NULL, CMD_NUM|CMD_ARGS, NULL },
+    { 'm', "multiline", "multiline", "percent of quoted values on many lines", "5", NULL, CMD_NUM|CMD_ARGS, NULL },
+    { 'c', "comments", "comments", "percent of values with a comment", "10", NULL, CMD_NUM|CMD_ARGS, NULL },
+    { 'r', "runs", "runs", "report the best of this many runs", "5", NULL, CMD_NUM|CMD_ARGS, NULL },
+    { 'l', "lookups", "lookups", "number of table lookups", "1000000", NULL, CMD_NUM|CMD_ARGS, NULL },
+    { 'a', "args", "args", "number of command line arguments", "100000", NULL, CMD_NUM|CMD_ARGS, NULL },
+    { 'S', "seed", "seed", "seed for the generator", "1", NULL, CMD_NUM|CMD_ARGS, NULL },
+    { 'o', "output", "output", "keep the generated file", NULL, NULL, CMD_STR|CMD_ARGS, NULL },
+    { 't', "trace", "trace", "save the trace events as Chrome JSON", NULL, NULL, CMD_STR|CMD_ARGS, NULL },
+    { 'u', "utf8", "utf8", "check that the file is valid UTF-8", NULL, NULL, CMD_NONE, NULL },
+    { 'h', "help", NULL, "print this help text", NULL, cb_cmdline_help, CMD_NONE, NULL },
+    CMDLINE_END
+};
+
+// Options for the command line that is parsed as a benchmark.
+static const cmdline_entry_t load_options[] = {
+    { 'p', "port", "port", "a number", NULL, NULL, CMD_NUM|CMD_ARGS, NULL },
+    { 'v', "verbose", "verbose", "a switch", NULL, NULL, CMD_NONE, NULL },
+    { 0, "name", "name", "a string", NULL, NULL, CMD_STR|CMD_ARGS, NULL },
+    { 0, NULL, "files", "the files", NULL, NULL, CMD_LIST, NULL },
+    CMDLINE_END
+};
+
+static double now(void) {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Names cannot have digits in them, so numbers are written in letters.
+ */
+static void append_name(string_t* str, char prefix, long num) {
+
+    append_string_char(str, prefix);
+    do {
+        append_string_char(str, 'a' + num % 26);
+        num /= 26;
+    } while(num > 0);
+}
+
+static void append_value(string_t* str, bench_params_t* p) {
+
+    static const char chars[] = "abcdefghijklmnopqrstuvwxyz0123456789._-";
+    long len = p->value_size / 2 + rand() % (p->value_size + 1);
+    int quoted = (rand() % 100) < p->quoted;
+    int multiline = quoted && (rand() % 100) < p->multiline;
+
+    if(len < 1)
+        len = 1;
+
+    if(quoted)
+        append_string_char(str, '\"');
+    for(long i = 0; i < len; i++) {
+        if(quoted && i > 0 && i+1 < len && rand() % 8 == 0)
+            append_string_char(str, (multiline && rand() % 2)? '\n': ' ');
+        else
+            append_string_char(str, chars[rand() % (sizeof(chars) - 1)]);
+    }
+    if(quoted)
+        append_string_char(str, '\"');
+}
+
+/*
+ * Make the text of the file and the full names of all of its keys. The keys
+ * are put in blocks, and each block is in sections that are nested up to
+ * the depth.
+ */
+static string_t* generate_config(bench_params_t* p, string_list_t* keys) {
+
+    string_t* text = create_string(NULL);
+    string_t* path = create_string(NULL);
+    string_t* key = create_string(NULL);
+    long block = 16;
+
+    srand(p->seed);
+    for(long base = 0; base < p->keys; base += block) {
+        long nest = (p->depth > 0)? (base / block) % (p->depth + 1): 0;
+
+        clear_string(path);
+        for(long d = 0; d < nest; d++) {
+            for(long i = 0; i < d; i++)
+                append_string_str(text, "  ");
+            clear_string(key);
+            append_name(key, 's', (d == 0)? base / block: d);
+            append_string_string(text, key);
+            append_string_str(text, " {\n");
+            append_string_string(path, key);
+            append_string_char(path, '.');
+        }
+
+        for(long n = base; n < base + block && n < p->keys; n++) {
+            if((rand() % 100) < p->comments) {
+                for(long i = 0; i < nest; i++)
+                    append_string_str(text, "  ");
+                append_string_str(text, "; a comment about the next value\n");
+            }
+
+            clear_string(key);
+            append_name(key, 'k', n);
+            for(long i = 0; i < nest; i++)
+                append_string_str(text, "  ");
+            append_string_string(text, key);
+            append_string_str(text, " = ");
+            append_value(text, p);
+            append_string_char(text, '\n');
+
+            string_t* full = copy_string(path);
+            append_string_string(full, key);
+            append_string_list(keys, full);
+        }
+
+        for(long d = nest; d > 0; d--) {
+            for(long i = 0; i < d-1; i++)
+                append_string_str(text, "  ");
+            append_string_str(text, "}\n");
+        }
+    }
+
+    destroy_string(path);
+    destroy_string(key);
+    return text;
+}
+
+static void destroy_table(hash_table_t* tab) {
+
+    for(size_t slot = 0; slot < tab->cap; slot++)
+        for(hash_entry_t* crnt = tab->table[slot]; crnt != NULL; crnt = crnt->next)
+            destroy_config_entry((config_entry_t*)crnt->val);
+
+    destroy_hash_table(tab);
+}
+
+/*
+ * Return the best time of the runs to scan the text into tokens.
+ */
+static double bench_scan(const char* fname, const char* text, size_t len, long runs) {
+
+    double best = 0.0;
+
+    for(long r = 0; r < runs; r++) {
+        double start = now();
+        init_scanner_buffer(fname, text, len, 0, 1);
+        while(consume_token()->type != TOK_END_OF_FILE)
+            ;
+        close_scanner();
+        double time = now() - start;
+        if(r == 0 || time < best)
+            best = time;
+    }
+
+    return best;
+}
+
+/*
+ * Return the best time of the runs to parse the file into a table. The
+ * last table is returned so that it can be used for the lookups.
+ */
+static double bench_parse(const char* fname, long runs, hash_table_t** table) {
+
+    double best = 0.0;
+
+    *table = NULL;
+    for(long r = 0; r < runs; r++) {
+        if(*table != NULL)
+            destroy_table(*table);
+        *table = create_hash_table();
+
+        double start = now();
+        parse_config_file(fname, *table, NULL);
+        double time = now() - start;
+        if(r == 0 || time < best)
+            best = time;
+    }
+
+    return best;
+}
+
+/*
+ * Return the best time per lookup, in nanoseconds.
+ */
+static double bench_lookup(hash_table_t* table, string_list_t* keys, long lookups, long runs) {
+
+    volatile uintptr_t sink = 0;
+    double best = 0.0;
+
+    for(long r = 0; r < runs; r++) {
+        double start = now();
+        for(long i = 0; i < lookups; i++)
+            sink += (uintptr_t)find_table_entry(table, raw_string(keys->list[i % keys->len]));
+        double time = now() - start;
+        if(r == 0 || time < best)
+            best = time;
+    }
+
+    (void)sink;
+    return (lookups > 0)? best * 1e9 / lookups: 0.0;
+}
+
+/*
+ * Return the best time to parse a command line with the number of
+ * arguments. Most of them are files, with some options mixed in.
+ */
+static double bench_cmdline(long nargs, long runs) {
+
+    char** argv = _ALLOC_ARRAY(char*, nargs + 2);
+    char buf[64];
+    double best = 0.0;
+
+    argv[0] = _DUP_STR("bench");
+    for(long i = 1; i <= nargs; i++) {
+        switch(i % 16) {
+            case 1: snprintf(buf, sizeof(buf), "-p%ld", i); break;
+            case 5: snprintf(buf, sizeof(buf), "--verb"); break;
+            case 9: snprintf(buf, sizeof(buf), "--name=n%ld", i); break;
+            default: snprintf(buf, sizeof(buf), "file%ld.txt", i); break;
+        }
+        argv[i] = _DUP_STR(buf);
+    }
+
+    config_t* cfg = init_configuration("bench", "", "");
+    add_cmdline_table(cfg, load_options);
+
+    for(long r = 0; r < runs; r++) {
+        double start = now();
+        parse_cmdline(cfg, nargs + 1, argv);
+        double time = now() - start;
+        if(r == 0 || time < best)
+            best = time;
+    }
+
+    for(long i = 0; i <= nargs; i++)
+        _FREE(argv[i]);
+    _FREE(argv);
+
+    return best;
+}
+
+int main(int argc, char** argv) {
+
+    bench_params_t p;
+    char tmp[] = "/tmp/bench-XXXXXX.cfg";
+
+    config_t* cfg = init_configuration("bench",
+        "Benchmark the configuration loader and print the results as JSON", "1.0");
+    add_cmdline_table(cfg, bench_options);
+
+    // only the command line is used, a config file or a layer next to the
+    // program would change the run and the loader prints to stdout
+    cfg->pname = _DUP_STR(argv[0]);
+    parse_cmdline(cfg, argc, argv);
+
+    p.keys = get_config_integer("keys");
+    p.depth = get_config_integer("depth");
+    p.value_size = get_config_integer("value_size");
+    p.quoted = get_config_integer("quoted");
+    p.multiline = get_config_integer("multiline");
+    p.comments = get_config_integer("comments");
+    p.runs = get_config_integer("runs");
+    p.lookups = get_config_integer("lookups");
+    p.args = get_config_integer("args");
+    p.seed = get_config_integer("seed");
+    p.output = get_config_str("output");
+    p.trace = get_config_str("trace");
+    p.utf8 = (get_config_str("utf8") != NULL);
+    set_utf8_check(p.utf8);
+
+    if(p.runs < 1)
+        p.runs = 1;
+
+    string_list_t* keys = create_string_list();
+    string_t* text = generate_config(&p, keys);
+
+    const char* fname = p.output;
+    FILE* fp;
+    if(fname == NULL) {
+        int fd = mkstemps(tmp, 4);
+        fp = (fd >= 0)? fdopen(fd, "w"): NULL;
+        fname = tmp;
+    }
+    else
+        fp = fopen(fname, "w");
+
+    if(fp == NULL || fwrite(text->buf, 1, text->len, fp) != (size_t)text->len || fclose(fp)) {
+        fprintf(stderr, "ERROR: Cannot write the generated file: %s\n", fname);
+        return 1;
+    }
+
+    double mb = text->len / (1024.0 * 1024.0);
+    double scan = bench_scan(fname, text->buf, text->len, p.runs);
+
+    hash_table_t* table;
+    double parse = bench_parse(fname, p.runs, &table);
+
+    double hit = bench_lookup(table, keys, p.lookups, p.runs);
+    for(int i = 0; i < keys->len; i++)
+        append_string_char(keys->list[i], '_');
+    double miss = bench_lookup(table, keys, p.lookups, p.runs);
+
+    double cmd = bench_cmdline(p.args, p.runs);
+
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+
+    printf("{\n");
+    printf("  \"params\": {\"keys\": %ld, \"depth\": %ld, \"value_size\": %ld, "
+            "\"quoted\": %ld, \"multiline\": %ld, \"comments\": %ld, "
+            "\"runs\": %ld, \"lookups\": %ld, \"args\": %ld, \"seed\": %ld, \"utf8\": %d},\n",
+            p.keys, p.depth, p.value_size, p.quoted, p.multiline, p.comments,
+            p.runs, p.lookups, p.args, p.seed, p.utf8);
+    printf("  \"file_bytes\": %lu,\n", (unsigned long)text->len);
+    printf("  \"table_entries\": %lu,\n", (unsigned long)table->len);
+    printf("  \"scan_mb_s\": %.2f,\n", (scan > 0)? mb / scan: 0.0);
+    printf("  \"parse_mb_s\": %.2f,\n", (parse > 0)? mb / parse: 0.0);
+    printf("  \"lookup_hit_ns\": %.2f,\n", hit);
+    printf("  \"lookup_miss_ns\": %.2f,\n", miss);
+    printf("  \"cmdline_args_s\": %.0f,\n", (cmd > 0)? p.args / cmd: 0.0);
+    printf("  \"peak_rss_kb\": %ld\n", ru.ru_maxrss);
+    printf("}\n");
+
+    if(p.output == NULL)
+        unlink(tmp);
+    if(p.trace != NULL)
+        save_trace(p.trace);
+
+    destroy_table(table);
+    destroy_string_list(keys);
+    destroy_string(text);
+
+    return 0;
+}
@@ -0,0 +1,491 @@
+/*
+ * Implement the compiled configuration cache.
+ *
+ * The image is laid out as a header, the index slots, the entry array and
+ * then the string pool. The cache is only used when the size and mtime of
+ * the source file match the header, or failing that, when the contents of
+ * the source still hash to the same value. Otherwise the caller falls back
+ * to parsing the text.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "cache_file.h"
+#include "memory.h"
+#include "config.h"
+
+/*
+ * Return the name of the cache file that belongs to the source file.
+ */
+static char* cache_name(const char* src) {
+
+    size_t len = strlen(src);
+    char* name = _ALLOC(len + sizeof(CACHE_SUFFIX));
+
+    memcpy(name, src, len);
+    memcpy(&name[len], CACHE_SUFFIX, sizeof(CACHE_SUFFIX));
+
+    return name;
+}
+
+/*
+ * Hash the source file contents. Return non-zero if the file could not be
+ * read.
+ */
+static int hash_source(const char* src, size_t size, uint64_t* hash) {
+
+    if(size == 0) {
+        *hash = hash_buffer(NULL, 0);
+        return 0;
+    }
+
+    int fd = open(src, O_RDONLY);
+    if(fd < 0)
+        return 1;
+
+    void* buf = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(buf == MAP_FAILED)
+        return 1;
+
+    *hash = hash_buffer(buf, size);
+    munmap(buf, size);
+
+    return 0;
+}
+
+/*
+ * Make sure that all of the offsets in the header are inside of the image.
+ */
+static int check_header(const cache_header_t* head, size_t size) {
+
+    if(memcmp(head->magic, CACHE_MAGIC, sizeof(head->magic)) ||
+                head->version != CACHE_VERSION)
+        return 1;
+
+    if(head->nslots == 0 || (head->nslots & (head->nslots - 1)))
+        return 1;
+
+    if((uint64_t)head->slot_off + (uint64_t)head->nslots * sizeof(uint32_t) > size ||
+        (uint64_t)head->entry_off + (uint64_t)head->nentries * sizeof(cache_entry_t) > size ||
+        (uint64_t)head->pool_off + head->pool_size > size)
+        return 1;
+
+    // the pool must be terminated so that a bad offset cannot run off the end
+    if(head->pool_size == 0 || ((const char*)head)[head->pool_off + head->pool_size - 1] != '\0')
+        return 1;
+
+    return 0;
+}
+
+/*
+ * Return non-zero if the image was not made from the source file as it is
+ * now. The contents are only hashed when the mtime does not match.
+ */
+static int check_source(const cache_header_t* head, const char* src) {
+
+    struct stat sst;
+
+    if(stat(src, &sst) || head->src_size != (uint64_t)sst.st_size)
+        return 1;
+
+    if(head->src_mtime != (int64_t)sst.st_mtim.tv_sec ||
+                head->src_mtime_ns != (int64_t)sst.st_mtim.tv_nsec) {
+        // touched but maybe not changed, so check the contents
+        uint64_t hash;
+        return hash_source(src, sst.st_size, &hash) || hash != head->src_hash;
+    }
+
+    return 0;
+}
+
+/*
+ * Map the image in the open file read-only and close the file. Return NULL
+ * if it is not a good image, or if the source is not NULL and the image was
+ * not made from it.
+ */
+static config_cache_t* map_cache(int fd, const char* src) {
+
+    struct stat cst;
+
+    if(fstat(fd, &cst) || (size_t)cst.st_size < sizeof(cache_header_t)) {
+        close(fd);
+        return NULL;
+    }
+
+    void* base = mmap(NULL, cst.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(base == MAP_FAILED)
+        return NULL;
+
+    const cache_header_t* head = (const cache_header_t*)base;
+    if(check_header(head, cst.st_size) || (src != NULL && check_source(head, src))) {
+        munmap(base, cst.st_size);
+        return NULL;
+    }
+
+    config_cache_t* cache = _ALLOC_DS(config_cache_t);
+    cache->base = (const uint8_t*)base;
+    cache->size = cst.st_size;
+    cache->head = head;
+    cache->ents = _ALLOC_ARRAY(config_entry_t*, head->nentries);
+
+    return cache;
+}
+
+/*
+ * Open and map the cache for the source file. Return NULL if there is no
+ * cache or if it does not match the source.
+ */
+config_cache_t* open_config_cache(const char* src) {
+
+    if(src == NULL)
+        return NULL;
+
+    char* name = cache_name(src);
+    int fd = open(name, O_RDONLY);
+    _FREE(name);
+    if(fd < 0)
+        return NULL;
+
+    return map_cache(fd, src);
+}
+
+/*
+ * Map the image that publish_config_cache() put in the shared memory object
+ * read-only. If the source is not NULL then the image must have been made
+ * from it. Return NULL if there is no image or it cannot be used.
+ */
+config_cache_t* attach_config_cache(const char* name, const char* src) {
+
+    int fd = shm_open(name, O_RDONLY, 0);
+    if(fd < 0)
+        return NULL;
+
+    return map_cache(fd, src);
+}
+
+/*
+ * Free an entry that was made by make_cache_entry(). The strings in it are
+ * in the image, but the expanded value is not.
+ */
+static void free_cache_entry(config_entry_t* ent) {
+
+    destroy_string(ent->raw);
+    destroy_string_list(ent->values);
+    destroy_config_entry(ent->expanded);
+    _FREE(ent);
+}
+
+/*
+ * Unmap the cache and free the memory associated with it.
+ */
+void close_config_cache(config_cache_t* cache) {
+
+    if(cache != NULL) {
+        for(uint32_t i = 0; i < cache->head->nentries; i++)
+            if(cache->ents[i] != NULL)
+                free_cache_entry(cache->ents[i]);
+        _FREE(cache->ents);
+        munmap((void*)cache->base, cache->size);
+        _FREE(cache);
+    }
+}
+
+/*
+ * Make the config entry for an entry in the image. The name, the value and
+ * the elements of an array refer to the pool. The elements are stored one
+ * after the other right after the value.
+ */
+static config_entry_t* make_cache_entry(const cache_header_t* head, const char* pool,
+                const cache_entry_t* cent) {
+
+    config_entry_t* ent = _ALLOC_DS(config_entry_t);
+    ent->name = &pool[cent->key];
+    ent->type = CFG_FILE;
+
+    size_t len = strlen(&pool[cent->val]);
+    ent->raw = create_string_view(&pool[cent->val], len);
+
+    if(cent->array) {
+        ent->values = create_string_list();
+        size_t pos = cent->val + len + 1;
+        for(uint32_t i = 0; i < cent->nitems && pos < head->pool_size; i++) {
+            len = strlen(&pool[pos]);
+            append_string_list(ent->values, create_string_view(&pool[pos], len));
+            pos += len + 1;
+        }
+    }
+
+    return ent;
+}
+
+/*
+ * Look up a key in the cache. Return NULL if it is not there. The entry
+ * belongs to the cache and its strings point into the read-only mapping, so
+ * the value is never copied. It is made the first time the key is looked
+ * up. Readers can race to make it, and the one that loses frees its copy.
+ */
+config_entry_t* find_cache_entry(config_cache_t* cache, const char* key) {
+
+    const cache_header_t* head = cache->head;
+    const uint32_t* slots = (const uint32_t*)(cache->base + head->slot_off);
+    const cache_entry_t* entries = (const cache_entry_t*)(cache->base + head->entry_off);
+    const char* pool = (const char*)(cache->base + head->pool_off);
+
+    uint32_t hash = (uint32_t)hash_key(key);
+    uint32_t idx = slots[hash & (head->nslots - 1)];
+
+    while(idx != 0 && idx <= head->nentries) {
+        const cache_entry_t* cent = &entries[idx - 1];
+        if(cent->hash == hash && cent->key < head->pool_size &&
+                    !strcmp(key, &pool[cent->key])) {
+            if(cent->val >= head->pool_size)
+                return NULL;
+
+            config_entry_t* ent = __atomic_load_n(&cache->ents[idx - 1], __ATOMIC_ACQUIRE);
+            if(ent == NULL) {
+                config_entry_t* fresh = make_cache_entry(head, pool, cent);
+                if(__atomic_compare_exchange_n(&cache->ents[idx - 1], &ent, fresh, 0,
+                            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+                    ent = fresh;
+                else
+                    free_cache_entry(fresh);
+            }
+            return ent;
+        }
+        idx = cent->next;
+    }
+
+    return NULL;
+}
+
+/*
+ * Add an entry for every value in the image to the table, in the order of
+ * the file. The entries belong to the table, but the values are read in
+ * place, so the cache has to be kept until the table is freed.
+ */
+void load_cache_table(config_cache_t* cache, hash_table_t* tab) {
+
+    const cache_header_t* head = cache->head;
+    const cache_entry_t* entries = (const cache_entry_t*)(cache->base + head->entry_off);
+    const char* pool = (const char*)(cache->base + head->pool_off);
+
+    for(uint32_t i = 0; i < head->nentries; i++) {
+        const cache_entry_t* cent = &entries[i];
+        if(cent->key >= head->pool_size || cent->val >= head->pool_size)
+            continue;
+
+        config_entry_t* ent = make_cache_entry(head, pool, cent);
+        ent->name = _DUP_STR(&pool[cent->key]);
+        add_table_entry(tab, ent->name, ent);
+    }
+}
+
+/*
+ * Serialize the CFG_FILE entries in the table into a new image. The values in
+ * the table are config_entry_t. The size of the image is returned in size.
+ * Return NULL if the source cannot be read or the image would be too big.
+ */
+static uint8_t* build_cache_image(const char* src, hash_table_t* tab, size_t* size) {
+
+    struct stat sst;
+    uint64_t src_hash;
+
+    if(src == NULL || stat(src, &sst) || hash_source(src, sst.st_size, &src_hash))
+        return NULL;
+
+    // the entries are stored in the order of the file
+    uint32_t nentries = 0;
+    size_t pool_size = 0;
+    size_t mark = 0;
+    const char* key;
+    config_entry_t* cent;
+    while(NULL != (cent = iter_table_entry(tab, &mark, &key))) {
+        if(cent->type & CFG_FILE) {
+            nentries++;
+            pool_size += strlen(key) + 1;
+            pool_size += cent->raw->len + 1;
+            for(int i = 0; cent->values != NULL && i < cent->values->len; i++)
+                pool_size += cent->values->list[i]->len + 1;
+        }
+    }
+
+    uint32_t nslots = 1 << 3;
+    while(nslots < nentries * 2)
+        nslots <<= 1;
+
+    size_t slot_off = sizeof(cache_header_t);
+    size_t entry_off = slot_off + nslots * sizeof(uint32_t);
+    size_t pool_off = entry_off + nentries * sizeof(cache_entry_t);
+    *size = pool_off + pool_size + 1;
+
+    if(*size > UINT32_MAX)
+        return NULL;
+
+    uint8_t* base = _ALLOC(*size);
+    cache_header_t* head = (cache_header_t*)base;
+    uint32_t* slots = (uint32_t*)(base + slot_off);
+    cache_entry_t* entries = (cache_entry_t*)(base + entry_off);
+    char* pool = (char*)(base + pool_off);
+
+    memcpy(head->magic, CACHE_MAGIC, sizeof(head->magic));
+    head->version = CACHE_VERSION;
+    head->nslots = nslots;
+    head->src_size = sst.st_size;
+    head->src_mtime = sst.st_mtim.tv_sec;
+    head->src_mtime_ns = sst.st_mtim.tv_nsec;
+    head->src_hash = src_hash;
+    head->nentries = nentries;
+    head->slot_off = slot_off;
+    head->entry_off = entry_off;
+    head->pool_off = pool_off;
+    head->pool_size = pool_size + 1;
+
+    uint32_t idx = 0;
+    size_t pos = 0;
+    mark = 0;
+    while(NULL != (cent = iter_table_entry(tab, &mark, &key))) {
+        if(cent->type & CFG_FILE) {
+            string_t* val = cent->raw;
+            string_list_t* items = cent->values;
+            cache_entry_t* ent = &entries[idx];
+
+            ent->hash = (uint32_t)hash_key(key);
+            ent->key = pos;
+            pos += strlen(key) + 1;
+            memcpy(&pool[ent->key], key, pos - ent->key);
+            ent->val = pos;
+            memcpy(&pool[pos], val->buf, val->len + 1);
+            pos += val->len + 1;
+
+            if(items != NULL) {
+                ent->array = 1;
+                ent->nitems = items->len;
+                for(int i = 0; i < items->len; i++) {
+                    memcpy(&pool[pos], items->list[i]->buf, items->list[i]->len + 1);
+                    pos += items->list[i]->len + 1;
+                }
+            }
+
+            ent->next = slots[ent->hash & (nslots - 1)];
+            slots[ent->hash & (nslots - 1)] = ++idx;
+        }
+    }
+
+    return base;
+}
+
+/*
+ * Write the table that was loaded from the source file into the cache.
+ * Failing to write the cache is not an error because the text is still
+ * there to fall back on.
+ */
+void save_config_cache(const char* src, hash_table_t* tab) {
+
+    size_t size;
+    uint8_t* base = build_cache_image(src, tab, &size);
+    if(base == NULL)
+        return;
+
+    // write it to the side and rename it so that readers never see a
+    // partial image
+    char* name = cache_name(src);
+    char* tmp = _ALLOC(strlen(name) + 8);
+    sprintf(tmp, "%s.XXXXXX", name);
+
+    int fd = mkstemp(tmp);
+    if(fd >= 0) {
+        fchmod(fd, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+
+        size_t done = 0;
+        while(done < size) {
+            ssize_t n = write(fd, base + done, size - done);
+            if(n <= 0)
+                break;
+            done += n;
+        }
+
+        if(close(fd) || done != size || rename(tmp, name)) {
+            fprintf(stderr, "WARNING: Cannot write configuration cache: %s: %s\n",
+                        name, strerror(errno));
+            unlink(tmp);
+        }
+    }
+
+    _FREE(tmp);
+    _FREE(name);
+    _FREE(base);
+}
+
+/*
+ * Put an image of the configuration into a POSIX shared memory object, so
+ * that other processes can look values up in it without parsing the source.
+ * If the cache is not NULL then its image is copied as it is, otherwise the
+ * table is serialized. A previous object with the same name is removed
+ * first. Processes that have it mapped keep the old image. The magic number
+ * is written last, so an image that is only partly written is never used.
+ * Return non-zero if the object could not be made.
+ */
+int publish_config_cache(const char* name, const char* src, hash_table_t* tab,
+                config_cache_t* cache) {
+
+    size_t size;
+    uint8_t* image = NULL;
+    const uint8_t* from;
+
+    if(cache != NULL) {
+        from = cache->base;
+        size = cache->size;
+    }
+    else if(NULL == (from = image = build_cache_image(src, tab, &size)))
+        return 1;
+
+    shm_unlink(name);
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if(fd < 0 || ftruncate(fd, size)) {
+        fprintf(stderr, "WARNING: Cannot publish configuration: %s: %s\n",
+                    name, strerror(errno));
+        if(fd >= 0) {
+            close(fd);
+            shm_unlink(name);
+        }
+        _FREE(image);
+        return 1;
+    }
+
+    uint8_t* base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(base == MAP_FAILED) {
+        fprintf(stderr, "WARNING: Cannot publish configuration: %s: %s\n",
+                    name, strerror(errno));
+        shm_unlink(name);
+        _FREE(image);
+        return 1;
+    }
+
+    size_t magic = sizeof(((cache_header_t*)NULL)->magic);
+    memcpy(base + magic, from + magic, size - magic);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(base, from, magic);
+
+    munmap(base, size);
+    _FREE(image);
+
+    return 0;
+}
+
+/*
+ * Remove the shared memory object. Processes that have it mapped can still
+ * use it.
+ */
+void unpublish_config_cache(const char* name) {
+
+    shm_unlink(name);
+}
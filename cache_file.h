@@ -0,0 +1,72 @@
+/*
+ * Compiled configuration cache public interface.
+ *
+ * The cache is a binary image of the parsed configuration file that lives
+ * next to it as "<name>.cfg.cache". Everything in it is addressed by offset
+ * from the beginning of the image, so it can be mapped read-only and used
+ * in place without fixing up any pointers. The same image can be put into
+ * a shared memory object, so that many processes use one copy of it. The
+ * values that are looked up are not copied out of it.
+ */
+#ifndef _CACHE_FILE_H_
+#define _CACHE_FILE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hash.h"
+#include "strlist.h"
+
+#define CACHE_MAGIC "CFGCACHE"
+#define CACHE_VERSION 2
+#define CACHE_SUFFIX ".cache"
+
+typedef struct _cache_header_t_ {
+    char magic[8];
+    uint32_t version;
+    uint32_t nslots;        // number of index slots, always a power of 2
+    uint64_t src_size;      // size of the source file in bytes
+    int64_t src_mtime;      // seconds part of the source mtime
+    int64_t src_mtime_ns;   // nanoseconds part of the source mtime
+    uint64_t src_hash;      // FNV-1a hash of the source file contents
+    uint32_t nentries;
+    uint32_t slot_off;      // offset of uint32_t slots[nslots]
+    uint32_t entry_off;     // offset of cache_entry_t entries[nentries]
+    uint32_t pool_off;      // offset of the string pool
+    uint32_t pool_size;
+    uint32_t pad;
+} cache_header_t;
+
+// Slots and next links hold an entry index plus one, so that zero can be
+// used as the end of a chain.
+typedef struct _cache_entry_t_ {
+    uint32_t hash;
+    uint32_t key;           // offset of the key in the string pool
+    uint32_t val;           // offset of the value in the string pool
+    uint32_t next;
+    uint32_t array;         // non-zero if the value is an array
+    uint32_t nitems;        // the elements follow the value in the pool
+} cache_entry_t;
+
+struct _config_entry_t_;
+
+// The entries that are handed out refer to the strings in the image. One is
+// made the first time its key is looked up, and it belongs to the cache.
+typedef struct _config_cache_t_ {
+    const uint8_t* base;
+    size_t size;
+    const cache_header_t* head;
+    struct _config_entry_t_** ents;
+} config_cache_t;
+
+config_cache_t* open_config_cache(const char* src);
+config_cache_t* attach_config_cache(const char* name, const char* src);
+void close_config_cache(config_cache_t* cache);
+void save_config_cache(const char* src, hash_table_t* tab);
+struct _config_entry_t_* find_cache_entry(config_cache_t* cache, const char* key);
+void load_cache_table(config_cache_t* cache, hash_table_t* tab);
+int publish_config_cache(const char* name, const char* src, hash_table_t* tab,
+                config_cache_t* cache);
+void unpublish_config_cache(const char* name);
+
+#endif /* _CACHE_FILE_H_ */
@@ -0,0 +1,1164 @@
+/*
+ * Check the behavior of the configuration loader. Each check writes the
+ * files that it needs into a scratch directory, loads them and compares
+ * what comes back. Run it with "make check". It prints the checks that fail
+ * and returns non-zero if any did.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <ftw.h>
+#include <sys/stat.h>
+#include <pthread.h>
+
+#include "config.h"
+#include "cmdline.h"
+#include "parse_file.h"
+#include "scan_file.h"
+#include "schema.h"
+#include "watch_file.h"
+
+#define CHECK(cond) check((cond), #cond, __LINE__)
+
+static int nchecks;
+static int nfailed;
+static char** env;
+static int stop;
+
+static void check(int ok, const char* what, int line) {
+
+    nchecks++;
+    if(!ok) {
+        nfailed++;
+        fprintf(stderr, "FAILED: check.c: %d: %s\n", line, what);
+    }
+}
+
+/*
+ * Write the text to a file in the scratch directory.
+ */
+static void write_file(const char* fname, const char* text) {
+
+    FILE* fp = fopen(fname, "w");
+    if(fp == NULL || fputs(text, fp) < 0 || fclose(fp)) {
+        fprintf(stderr, "ERROR: Cannot write %s\n", fname);
+        exit(1);
+    }
+}
+
+/*
+ * Write "<name>.cfg" for a configuration. The file is found next to the
+ * program name, so an empty file with the name is made too.
+ */
+static void write_config(const char* name, const char* text) {
+
+    char fname[64];
+
+    write_file(name, "");
+    snprintf(fname, sizeof(fname), "%s.cfg", name);
+    write_file(fname, text);
+}
+
+/*
+ * Load the configuration that write_config() wrote. It becomes the one that
+ * get_config() uses. Without arguments, the command line is only the name.
+ */
+static config_t* load_config(const char* name, int argc, char** argv) {
+
+    char* args[] = { (char*)name, NULL };
+
+    config_t* cfg = init_configuration(name, "", "");
+    if(argv == NULL) {
+        argc = 1;
+        argv = args;
+    }
+    load_configuration(cfg, argc, argv, env);
+
+    return cfg;
+}
+
+static int remove_path(const char* path, const struct stat* st, int flag, struct FTW* ftw) {
+
+    (void)st;
+    (void)flag;
+    (void)ftw;
+    return remove(path);
+}
+
+/*
+ * A file with several mistakes in it has one error for each of them.
+ */
+static void check_errors(void) {
+
+    write_file("errors.cfg",
+            "a {\n"
+            "    x =\n"
+            "}\n"
+            "}\n"
+            "b {\n"
+            "    z = [1, 2\n"
+            "    w = 3\n"
+            "}\n");
+
+    config_errors_t* errs = create_error_list();
+    CHECK(check_config_file("errors.cfg", errs) == 3);
+    CHECK(errs->len == 3);
+    if(errs->len == 3) {
+        CHECK(errs->list[0].line == 3);     // the missing value
+        CHECK(errs->list[1].line == 4);     // the extra '}'
+        CHECK(errs->list[2].line == 7);     // the missing ']'
+    }
+
+    // the same list can collect the errors of more than one file
+    write_file("good.cfg", "a {\n    x = 1\n}\n");
+    CHECK(check_config_file("good.cfg", errs) == 0);
+    CHECK(check_config_file("errors.cfg", errs) == 3);
+    CHECK(errs->len == 6);
+
+    destroy_error_list(errs);
+}
+
+/*
+ * The compiled cache is written by the first load and used by the next one,
+ * until the text of the file changes. Touching the file without changing
+ * it does not throw the cache away.
+ */
+static void check_cache(void) {
+
+    const char* text = "s {\n    v = one\n    arr = [a, b]\n}\n";
+    write_config("cached", text);
+
+    config_t* cfg = load_config("cached", 0, NULL);
+    CHECK(!cfg->stats.cache_hit);
+    CHECK(access("cached.cfg.cache", R_OK) == 0);
+
+    cfg = load_config("cached", 0, NULL);
+    CHECK(cfg->stats.cache_hit);
+    CHECK(!strcmp(get_config_str("s.v"), "one"));
+    CHECK(get_config_array_len("s.arr") == 2);
+    CHECK(!strcmp(get_config_array_item("s.arr", 1)->buf, "b"));
+    CHECK(get_config("s.none") == NULL);
+
+    // the same size, so only the hash can tell
+    write_config("cached", "s {\n    v = two\n    arr = [a, b]\n}\n");
+    cfg = load_config("cached", 0, NULL);
+    CHECK(!cfg->stats.cache_hit);
+    CHECK(!strcmp(get_config_str("s.v"), "two"));
+
+    write_config("cached", "s {\n    v = two\n    arr = [a, b]\n}\n");
+    cfg = load_config("cached", 0, NULL);
+    CHECK(cfg->stats.cache_hit);
+    CHECK(!strcmp(get_config_str("s.v"), "two"));
+}
+
+/*
+ * Write a file with the keys s.kaa, s.kba and so on, all with the value.
+ */
+static void write_many(const char* name, int nkeys, const char* val) {
+
+    char line[64];
+    string_t* text = create_string("s {\n");
+
+    for(int i = 0; i < nkeys; i++) {
+        snprintf(line, sizeof(line), "    k%c%c = %s\n", 'a' + i % 26, 'a' + i / 26, val);
+        append_string_str(text, line);
+    }
+    append_string_str(text, "}\n");
+
+    write_config(name, raw_string(text));
+    destroy_string(text);
+}
+
+/*
+ * Read the values written by write_many() until told to stop and return
+ * how many were not one of the values that the file ever had.
+ */
+static void* read_many(void* arg) {
+
+    int nkeys = *(int*)arg;
+    long bad = 0;
+    char name[16];
+
+    while(!__atomic_load_n(&stop, __ATOMIC_ACQUIRE)) {
+        for(int i = 0; i < nkeys; i++) {
+            snprintf(name, sizeof(name), "s.k%c%c", 'a' + i % 26, 'a' + i / 26);
+            string_t* str = get_config_string(name);
+            if(str == NULL || (strcmp(str->buf, "one") && strcmp(str->buf, "two")))
+                bad++;
+            destroy_string(str);
+        }
+    }
+
+    return (void*)bad;
+}
+
+/*
+ * Readers never see a missing or broken value while the file is reloaded
+ * under them. The configuration starts out in the cache, so the first
+ * reads come from the mapping while the first reload swaps in a table.
+ */
+static void check_reload(void) {
+
+    int nkeys = 200;
+    pthread_t threads[4];
+    long bad = 0;
+    void* ret;
+
+    write_many("reload", nkeys, "one");
+    load_config("reload", 0, NULL);
+    config_t* cfg = load_config("reload", 0, NULL);
+    CHECK(cfg->stats.cache_hit);
+
+    __atomic_store_n(&stop, 0, __ATOMIC_RELEASE);
+    for(int i = 0; i < 4; i++)
+        pthread_create(&threads[i], NULL, read_many, &nkeys);
+
+    for(int i = 0; i < 40; i++) {
+        write_many("reload", nkeys, (i % 2)? "one": "two");
+        reload_configuration(cfg);
+    }
+
+    __atomic_store_n(&stop, 1, __ATOMIC_RELEASE);
+    for(int i = 0; i < 4; i++) {
+        pthread_join(threads[i], &ret);
+        bad += (long)ret;
+    }
+
+    CHECK(bad == 0);
+    CHECK(!strcmp(get_config_str("s.kaa"), "one"));
+    CHECK(!strcmp(get_config_str("s.kzf"), "one"));
+}
+
+/*
+ * Escapes in quoted strings are replaced by what they stand for, and a
+ * backslash that does not start one is kept.
+ */
+static void check_escapes(void) {
+
+    write_config("escapes",
+            "s {\n"
+            "    nl = \"a\\nb\"\n"
+            "    tab = \"a\\tb\"\n"
+            "    quote = \"say \\\"hi\\\"\"\n"
+            "    back = \"a\\\\b\"\n"
+            "    u = \"caf\\u00e9\"\n"
+            "    big = \"\\U0001F600\"\n"
+            "    path = \"C:\\dir\"\n"
+            "    arr = [\"x\\ty\", \"\\u00e9\"]\n"
+            "}\n");
+
+    load_config("escapes", 0, NULL);
+    CHECK(!strcmp(get_config_str("s.nl"), "a\nb"));
+    CHECK(!strcmp(get_config_str("s.tab"), "a\tb"));
+    CHECK(!strcmp(get_config_str("s.quote"), "say \"hi\""));
+    CHECK(!strcmp(get_config_str("s.back"), "a\\b"));
+    CHECK(!strcmp(get_config_str("s.u"), "caf\xc3\xa9"));
+    CHECK(!strcmp(get_config_str("s.big"), "\xf0\x9f\x98\x80"));
+    CHECK(!strcmp(get_config_str("s.path"), "C:\\dir"));
+    CHECK(get_config_array_len("s.arr") == 2);
+    CHECK(!strcmp(get_config_array_item("s.arr", 0)->buf, "x\ty"));
+    CHECK(!strcmp(get_config_array_item("s.arr", 1)->buf, "\xc3\xa9"));
+}
+
+/*
+ * With the check turned on, a file that is not UTF-8 has an error at the
+ * first bad byte. Overlong forms and surrogates are bad too.
+ */
+static void check_utf8(void) {
+
+    int prev = set_utf8_check(1);
+    config_errors_t* errs = create_error_list();
+
+    write_file("utf8.cfg", "s {\n    v = \"caf\xc3\xa9 \xf0\x9f\x98\x80\"\n}\n");
+    CHECK(check_config_file("utf8.cfg", errs) == 0);
+
+    write_file("latin1.cfg", "s {\n    v = \"caf\xe9\"\n}\n");
+    CHECK(check_config_file("latin1.cfg", errs) == 1);
+    if(errs->len == 1) {
+        CHECK(errs->list[0].line == 2);
+        CHECK(errs->list[0].col == 13);
+    }
+
+    write_file("overlong.cfg", "s {\n    v = \"\xc0\xaf\"\n}\n");
+    CHECK(check_config_file("overlong.cfg", errs) == 1);
+    write_file("surrogate.cfg", "s {\n    v = \"\xed\xa0\x80\"\n}\n");
+    CHECK(check_config_file("surrogate.cfg", errs) == 1);
+
+    // off, the bytes are taken as they are
+    set_utf8_check(0);
+    CHECK(check_config_file("latin1.cfg", errs) == 0);
+
+    destroy_error_list(errs);
+    set_utf8_check(prev);
+}
+
+/*
+ * Send what is printed on stderr to a file from now on, or put it back
+ * when the file is NULL. Return the number of lines that have the text.
+ */
+static int capture_stderr(const char* fname, const char* text) {
+
+    static int saved = -1;
+    char line[256];
+    int count = 0;
+
+    fflush(stderr);
+    if(fname != NULL) {
+        saved = dup(2);
+        FILE* fp = fopen(fname, "w");
+        dup2(fileno(fp), 2);
+        fclose(fp);
+        return 0;
+    }
+
+    dup2(saved, 2);
+    close(saved);
+
+    FILE* fp = fopen("stderr.txt", "r");
+    while(fp != NULL && fgets(line, sizeof(line), fp) != NULL)
+        if(strstr(line, text) != NULL)
+            count++;
+    if(fp != NULL)
+        fclose(fp);
+
+    return count;
+}
+
+/*
+ * References are replaced by their values. A value that leads back to
+ * itself is not defined, and neither is one that refers to it, every time
+ * that they are read, but that is only warned about the first time. A
+ * value that is too deep by itself is not defined, but one that is part of
+ * its chain can still be.
+ */
+static void check_references(void) {
+
+    char line[64];
+    string_t* text = create_string(
+            "s {\n"
+            "    name = world\n"
+            "    hello = \"hello ${s.name}\"\n"
+            "    twice = \"${s.hello}, ${s.hello}\"\n"
+            "    none = \"[${s.missing}]\"\n"
+            "    a = \"${s.b}\"\n"
+            "    b = \"x${s.a}\"\n"
+            "    self = \"${s.self}\"\n"
+            "    uses = \"y${s.a}\"\n");
+
+    // s.da refers to s.db and so on, to s.dr
+    for(int i = 0; i < 17; i++) {
+        snprintf(line, sizeof(line), "    d%c = \"${s.d%c}\"\n", 'a' + i, 'a' + i + 1);
+        append_string_str(text, line);
+    }
+    append_string_str(text, "    dr = end\n}\n");
+    write_config("refs", raw_string(text));
+    destroy_string(text);
+
+    load_config("refs", 0, NULL);
+    CHECK(!strcmp(get_config_str("s.hello"), "hello world"));
+    CHECK(!strcmp(get_config_str("s.twice"), "hello world, hello world"));
+    CHECK(!strcmp(get_config_str("s.none"), "[]"));
+
+    for(int i = 0; i < 2; i++) {
+        capture_stderr("stderr.txt", NULL);
+        CHECK(get_config("s.a") == NULL);
+        CHECK(get_config("s.b") == NULL);
+        CHECK(get_config("s.self") == NULL);
+        CHECK(get_config("s.uses") == NULL);
+        CHECK(get_config("s.da") == NULL);
+        int count = capture_stderr(NULL, "circular or too deep");
+        CHECK((i == 0)? count > 0: count == 0);
+    }
+
+    // a cycle does not spoil the reads after it
+    CHECK(!strcmp(get_config_str("s.hello"), "hello world"));
+    CHECK(!strcmp(get_config_str("s.dc"), "end"));
+    CHECK(get_config("s.da") == NULL);
+}
+
+/*
+ * Find a name in the list of changes and return what happened to it, or -1
+ * if it is not there.
+ */
+static int find_change(config_changes_t* changes, const char* name) {
+
+    for(int i = 0; i < changes->len; i++)
+        if(!strcmp(changes->list[i].name, name))
+            return changes->list[i].type;
+
+    return -1;
+}
+
+/*
+ * Updating in place lists what was added, changed and removed, and a value
+ * whose references lead to a changed one. Sections that did not change are
+ * left alone. A changed section with errors leaves everything as it was.
+ */
+static void check_update(void) {
+
+    write_config("update",
+            "a {\n"
+            "    x = 1\n"
+            "    y = 2\n"
+            "}\n"
+            "b {\n"
+            "    ref = \"<${a.x}>\"\n"
+            "    same = 3\n"
+            "}\n");
+
+    // the first load parses the file, so its sections are known
+    config_t* cfg = load_config("update", 0, NULL);
+    CHECK(!cfg->stats.cache_hit);
+    CHECK(!strcmp(get_config_str("b.ref"), "<1>"));
+
+    write_config("update",
+            "a {\n"
+            "    x = 10\n"
+            "    z = 4\n"
+            "}\n"
+            "b {\n"
+            "    ref = \"<${a.x}>\"\n"
+            "    same = 3\n"
+            "}\n");
+
+    config_changes_t* changes = update_configuration(cfg);
+    CHECK(changes != NULL);
+    if(changes != NULL) {
+        CHECK(changes->len == 4);
+        CHECK(find_change(changes, "a.x") == CFG_UPDATED);
+        CHECK(find_change(changes, "a.z") == CFG_ADDED);
+        CHECK(find_change(changes, "a.y") == CFG_REMOVED);
+        CHECK(find_change(changes, "b.ref") == CFG_UPDATED);
+        CHECK(find_change(changes, "b.same") == -1);
+        destroy_config_changes(changes);
+    }
+
+    CHECK(!strcmp(get_config_str("a.x"), "10"));
+    CHECK(!strcmp(get_config_str("a.z"), "4"));
+    CHECK(get_config("a.y") == NULL);
+    CHECK(!strcmp(get_config_str("b.ref"), "<10>"));
+
+    // a section with errors is not applied at all
+    write_config("update",
+            "a {\n"
+            "    x = 20\n"
+            "    z =\n"
+            "}\n"
+            "b {\n"
+            "    ref = \"<${a.x}>\"\n"
+            "    same = 3\n"
+            "}\n");
+
+    CHECK(update_configuration(cfg) == NULL);
+    CHECK(!strcmp(get_config_str("a.x"), "10"));
+    CHECK(!strcmp(get_config_str("b.ref"), "<10>"));
+}
+
+/*
+ * An "@file" argument is replaced by the arguments in the file, which use
+ * quotes and comments like the shell and can name other files. One that
+ * cannot be read is used as it is.
+ */
+static void check_response_files(void) {
+
+    char* argv[] = { "respond", "@args.txt", "last", "@nothere", NULL };
+
+    write_config("respond", "s {\n    v = 1\n}\n");
+    write_file("args.txt",
+            "--port 42  # the port\n"
+            "\"a b\" 'c d' e\\ f\n"
+            "@more.txt\n");
+    write_file("more.txt", "--name \"x y\" g\n");
+
+    config_t* cfg = init_configuration("respond", "", "");
+    add_cmdline(cfg, 'p', "port", "port", "the port", "1", NULL, CMD_ARGS|CMD_NUM);
+    add_cmdline(cfg, 'n', "name", "name", "the name", "", NULL, CMD_ARGS|CMD_STR);
+    add_cmdline(cfg, 0, NULL, "files", "the files", NULL, NULL, CMD_LIST|CMD_STR);
+    load_configuration(cfg, 4, argv, env);
+
+    CHECK(get_config_integer("port") == 42);
+    CHECK(!strcmp(get_config_str("name"), "x y"));
+    CHECK(get_config_array_len("files") == 6);
+    if(get_config_array_len("files") == 6) {
+        CHECK(!strcmp(get_config_array_item("files", 0)->buf, "a b"));
+        CHECK(!strcmp(get_config_array_item("files", 1)->buf, "c d"));
+        CHECK(!strcmp(get_config_array_item("files", 2)->buf, "e f"));
+        CHECK(!strcmp(get_config_array_item("files", 3)->buf, "g"));
+        CHECK(!strcmp(get_config_array_item("files", 4)->buf, "last"));
+        CHECK(!strcmp(get_config_array_item("files", 5)->buf, "@nothere"));
+    }
+}
+
+static int ncalled;
+static int callback_ok;
+static int expect_changes;
+
+/*
+ * A reload callback that reads values that come from an upper layer and
+ * from the environment. Neither has been read before, so the reads have to
+ * load the layer and index the environment.
+ */
+static void read_in_callback(config_t* cfg) {
+
+    const char* v = get_config_str("s.v");
+    const char* u = get_config_str("s.u");
+    const char* e = get_config_str("s.e");
+
+    ncalled++;
+    callback_ok = (v != NULL && !strcmp(v, "2") && u != NULL && !strcmp(u, "upper") &&
+                e != NULL && !strcmp(e, "env") && (cfg->changes != NULL) == expect_changes);
+}
+
+/*
+ * Load a configuration with an upper layer in ~/.config and an environment
+ * prefix, change the file, and reload or update it with a callback that
+ * reads values. The callback runs without the lock, so it does not hang.
+ */
+static void check_callback_for(const char* name, int update) {
+
+    char* envs[] = { "CB_S_E=env", NULL };
+    char* argv[] = { (char*)name, NULL };
+    char fname[64];
+
+    write_config(name, "s {\n    v = 1\n    u = file\n}\n");
+    snprintf(fname, sizeof(fname), ".config/%s.cfg", name);
+    write_file(fname, "s {\n    u = upper\n}\n");
+
+    config_t* cfg = init_configuration(name, "", "");
+    set_config_env_prefix(cfg, "CB_");
+    load_configuration(cfg, 1, argv, envs);
+    add_config_reload(cfg, read_in_callback);
+
+    write_config(name, "s {\n    v = 2\n    u = file\n}\n");
+    ncalled = 0;
+    callback_ok = 0;
+    expect_changes = update;
+    if(update)
+        destroy_config_changes(update_configuration(cfg));
+    else
+        reload_configuration(cfg);
+
+    CHECK(ncalled == 1);
+    CHECK(callback_ok);
+}
+
+static void check_callbacks(void) {
+
+    mkdir(".config", 0755);
+    check_callback_for("cbreload", 0);
+    check_callback_for("cbupdate", 1);
+}
+
+static int nupdates;
+
+static void count_updates(config_t* cfg) {
+
+    if(cfg->changes != NULL)
+        __atomic_add_fetch(&nupdates, 1, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Wait up to five seconds for the value to be the one that is expected.
+ */
+static int wait_for_value(const char* name, const char* val) {
+
+    for(int i = 0; i < 500; i++) {
+        const char* str = get_config_str(name);
+        if(str != NULL && !strcmp(str, val))
+            return 1;
+        usleep(10000);
+    }
+
+    return 0;
+}
+
+/*
+ * The watcher applies an edit of the file with update_configuration(), both
+ * when the file is written in place and when a new one is renamed over it.
+ */
+static void check_watch(void) {
+
+    write_config("watched", "s {\n    v = 1\n}\n");
+    config_t* cfg = load_config("watched", 0, NULL);
+    add_config_reload(cfg, count_updates);
+    CHECK(start_config_watch(cfg) == 0);
+
+    write_config("watched", "s {\n    v = 2\n}\n");
+    CHECK(wait_for_value("s.v", "2"));
+
+    write_file("watched.tmp", "s {\n    v = 3\n}\n");
+    CHECK(rename("watched.tmp", "watched.cfg") == 0);
+    CHECK(wait_for_value("s.v", "3"));
+
+    stop_config_watch(cfg);
+    CHECK(cfg->watch == NULL);
+    CHECK(__atomic_load_n(&nupdates, __ATOMIC_SEQ_CST) >= 2);
+
+    // a file in the root directory watches the root directory
+    cfg = init_configuration("rooted", "", "");
+    cfg->fname = "/rooted.cfg";
+    CHECK(start_config_watch(cfg) == 0);
+    if(cfg->watch != NULL) {
+        CHECK(!strcmp(cfg->watch->dir, "/"));
+        CHECK(!strcmp(cfg->watch->base, "rooted.cfg"));
+        stop_config_watch(cfg);
+    }
+    cfg->fname = NULL;
+}
+
+#define CHECK_SCHEMA(VAL, OPT, DIV) \
+    VAL(port, "port", INTEGER, "80", 'p', "port", "the port", CMD_ARGS) \
+    VAL(host, "srv.host", STR, "localhost", 0, NULL, NULL, 0) \
+    VAL(size, "srv.size", UNSIGNED, "1", 0, NULL, NULL, 0) \
+    VAL(ratio, "srv.ratio", FLOAT, "0.5", 0, NULL, NULL, 0) \
+    VAL(debug, "srv.debug", BOOL, "false", 0, NULL, NULL, 0) \
+    VAL(user, "srv.user", STR, "nobody", 0, NULL, NULL, 0) \
+    VAL(names, "srv.names", LIST, NULL, 0, NULL, NULL, 0) \
+    VAL(files, "files", LIST, NULL, 0, NULL, "the files", CMD_LIST)
+
+CONFIG_SCHEMA_STRUCT(check_config_t, CHECK_SCHEMA);
+CONFIG_SCHEMA_TABLE(check_schema, check_config_t, CHECK_SCHEMA)
+
+static check_config_t settings;
+
+static void refill_schema(config_t* cfg) {
+
+    fill_config_schema(cfg);
+}
+
+/*
+ * The struct is filled in from the file, an upper layer, the environment,
+ * the command line and the defaults when the configuration is loaded, and
+ * again from a reload callback after the file changes.
+ */
+static void check_schema_fields(void) {
+
+    char* envs[] = { "SCH_SRV_USER=admin", NULL };
+    char* argv[] = { "schema", "--port", "9000", "a", "b", NULL };
+
+    write_config("schema",
+            "srv {\n"
+            "    host = example.org\n"
+            "    size = 4096\n"
+            "    ratio = 0.25\n"
+            "    debug = true\n"
+            "    names = [x, y, z]\n"
+            "}\n");
+    write_file(".config/schema.cfg", "srv {\n    size = 8192\n}\n");
+
+    config_t* cfg = init_configuration("schema", "", "");
+    set_config_env_prefix(cfg, "SCH_");
+    add_config_schema(cfg, check_schema(), &settings);
+    load_configuration(cfg, 5, argv, envs);
+    add_config_reload(cfg, refill_schema);
+
+    CHECK(settings.port == 9000);
+    CHECK(settings.host != NULL && !strcmp(settings.host, "example.org"));
+    CHECK(settings.size == 8192);
+    CHECK(settings.ratio == 0.25);
+    CHECK(settings.debug == 1);
+    CHECK(settings.user != NULL && !strcmp(settings.user, "admin"));
+    CHECK(settings.names == 3);
+    CHECK(settings.files == 2);
+
+    write_config("schema", "srv {\n    ratio = 2.5\n    names = [x]\n}\n");
+    reload_configuration(cfg);
+
+    CHECK(settings.port == 9000);
+    CHECK(settings.host != NULL && !strcmp(settings.host, "localhost"));
+    CHECK(settings.size == 8192);
+    CHECK(settings.ratio == 2.5);
+    CHECK(settings.debug == 0);
+    CHECK(settings.user != NULL && !strcmp(settings.user, "admin"));
+    CHECK(settings.names == 1);
+    CHECK(settings.files == 2);
+}
+
+/*
+ * Go through the configuration and put the names in a string, separated by
+ * spaces.
+ */
+static void iter_names(config_t* cfg, char* buf, size_t size) {
+
+    size_t mark = 0;
+    config_entry_t* ent;
+
+    buf[0] = '\0';
+    while(NULL != (ent = iter_config(cfg, &mark)))
+        snprintf(&buf[strlen(buf)], size - strlen(buf), "%s%s", (buf[0] != '\0')? " ": "", ent->name);
+}
+
+/*
+ * A lazy load parses a section when one of its names is looked up, but
+ * iterating still goes in the order of the file, and a top level key is
+ * found the same as a key in a section.
+ */
+static void check_lazy(void) {
+
+    char* argv[] = { "lazy", NULL };
+    char names[256];
+
+    write_config("lazy",
+            "a {\n    x = 1\n    y = 2\n}\n"
+            "b {\n    z = 3\n    w = 4\n}\n"
+            "top = 5\n");
+
+    config_t* cfg = init_configuration("lazy", "", "");
+    set_config_lazy(cfg, 1);
+    load_configuration(cfg, 1, argv, env);
+    CHECK(cfg->pending != NULL && cfg->npending == 3);
+
+    CHECK(!strcmp(get_config_str("b.z"), "3"));
+    CHECK(cfg->npending == 2);
+    CHECK(!strcmp(get_config_str("top"), "5"));
+    CHECK(cfg->npending == 1);
+    CHECK(get_config("b.none") == NULL);
+    CHECK(get_config("none") == NULL);
+    CHECK(!strcmp(get_config_str("a.y"), "2"));
+    CHECK(cfg->pending == NULL);
+
+    // everything is parsed, but in the order that it was looked up
+    iter_names(cfg, names, sizeof(names));
+    CHECK(!strcmp(names, "a.x a.y b.z b.w top"));
+
+    // the order holds after another value is added
+    add_config(cfg, "extra", create_string("6"), CFG_CMD);
+    iter_names(cfg, names, sizeof(names));
+    CHECK(!strcmp(names, "a.x a.y b.z b.w top extra"));
+}
+
+/*
+ * A snapshot or an iteration of a configuration that came from the cache
+ * gets every value from the cache, in the order of the file, without
+ * parsing the file or writing the cache again. The command line still
+ * overrides the file.
+ */
+static void check_cached_snapshot(void) {
+
+    char* argv[] = { "snapcache", "--port", "9", NULL };
+    char names[256];
+    struct stat before;
+    struct stat after;
+
+    write_config("snapcache", "s {\n    b = 1\n    a = 2\n}\nport = 3\nlast = 4\n");
+    load_config("snapcache", 0, NULL);
+    CHECK(stat("snapcache.cfg.cache", &before) == 0);
+
+    config_t* cfg = init_configuration("snapcache", "", "");
+    add_cmdline(cfg, 'p', "port", "port", "the port", NULL, NULL, CMD_ARGS|CMD_NUM);
+    load_configuration(cfg, 3, argv, env);
+    CHECK(cfg->stats.cache_hit);
+
+    config_snapshot_t* snap = acquire_config_snapshot(cfg);
+    CHECK(!strcmp(get_snapshot_config(snap, "s.a")->buf, "2"));
+    CHECK(!strcmp(get_snapshot_config(snap, "port")->buf, "9"));
+    CHECK(!strcmp(get_snapshot_config(snap, "last")->buf, "4"));
+    release_config_snapshot(snap);
+
+    iter_names(cfg, names, sizeof(names));
+    CHECK(!strcmp(names, "s.b s.a port last"));
+    CHECK(!strcmp(get_config_str("port"), "9"));
+    CHECK(!strcmp(get_config_str("s.b"), "1"));
+
+    CHECK(stat("snapcache.cfg.cache", &after) == 0);
+    CHECK(before.st_ino == after.st_ino && before.st_mtime == after.st_mtime);
+}
+
+/*
+ * Each name comes from the source with the highest precedence that has it:
+ * the command line, the environment, ./<name>.cfg, ~/.config/<name>.cfg,
+ * the main file, a lower layer, and then the defaults of the options. The
+ * main file is next to the program, which is in a directory of its own
+ * here so that ./<name>.cfg is a different file.
+ */
+static void check_layers(void) {
+
+    char* envs[] = { "LAY_L_CMD=env", "LAY_L_ENV=env", NULL };
+    char* argv[] = { "sub/layered", "--cmd", "cmd", NULL };
+    const char* names[] = { "cmd", "env", "cwd", "home", "file", "lower", "def" };
+
+    mkdir("sub", 0755);
+    write_config("sub/layered",
+            "l {\n    cmd = file\n    env = file\n    cwd = file\n    home = file\n"
+            "    file = file\n}\n");
+    write_file("layered.cfg",
+            "l {\n    cmd = cwd\n    env = cwd\n    cwd = cwd\n}\n");
+    write_file(".config/layered.cfg",
+            "l {\n    cmd = home\n    env = home\n    cwd = home\n    home = home\n}\n");
+    write_file("lower.cfg",
+            "l {\n    cmd = lower\n    file = lower\n    lower = lower\n}\n");
+
+    config_t* cfg = init_configuration("layered", "", "");
+    set_config_env_prefix(cfg, "LAY_");
+    add_cmdline(cfg, 0, "cmd", "l.cmd", "", "def", NULL, CMD_ARGS|CMD_STR);
+    add_cmdline(cfg, 0, "lower", "l.lower", "", "def", NULL, CMD_ARGS|CMD_STR);
+    add_cmdline(cfg, 0, "def", "l.def", "", "def", NULL, CMD_ARGS|CMD_STR);
+    // lower layers are searched in the order that they were added, and the
+    // defaults are added by the load
+    add_config_layer(cfg, "lower.cfg", 0);
+    load_configuration(cfg, 3, argv, envs);
+
+    // the layers are found, but not read until a lookup gets to them
+    CHECK(cfg->upper != NULL && cfg->upper->next != NULL && !cfg->upper->loaded);
+    CHECK(cfg->lower != NULL);
+
+    for(int i = 0; i < 7; i++) {
+        char name[16];
+        snprintf(name, sizeof(name), "l.%s", names[i]);
+        const char* val = get_config_str(name);
+        CHECK(val != NULL && !strcmp(val, names[i]));
+    }
+    CHECK(get_config("l.none") == NULL);
+
+    // a layer with errors is skipped
+    write_file("broken.cfg", "l {\n    none =\n}\n");
+    add_config_layer(cfg, "broken.cfg", 0);
+    capture_stderr("stderr.txt", NULL);
+    CHECK(get_config("l.none") == NULL);
+    CHECK(capture_stderr(NULL, "Skipping configuration layer") == 1);
+}
+
+/*
+ * The command line still overrides a section that is parsed after it was
+ * stored. Sections with the same name are parsed when the file is loaded,
+ * because they can define the same keys. Updating while some sections are
+ * not parsed yet reloads the whole file.
+ */
+static void check_lazy_overrides(void) {
+
+    char* argv[] = { "lazier", "--x", "cmd", NULL };
+
+    write_config("lazier",
+            "a {\n    x = file\n    y = file\n}\n"
+            "c {\n    v = 1\n}\n"
+            "b {\n    z = 1\n}\n"
+            "c {\n    v = 2\n}\n");
+
+    config_t* cfg = init_configuration("lazier", "", "");
+    add_cmdline(cfg, 0, "x", "a.x", "", NULL, NULL, CMD_ARGS|CMD_STR);
+    set_config_lazy(cfg, 1);
+    load_configuration(cfg, 3, argv, env);
+
+    CHECK(cfg->npending == 2);
+    CHECK(!strcmp(get_config_str("c.v"), "2"));
+    CHECK(!strcmp(get_config_str("a.x"), "cmd"));
+    CHECK(!strcmp(get_config_str("a.y"), "file"));
+    CHECK(cfg->npending == 1);
+
+    write_config("lazier", "a {\n    x = file\n    y = new\n}\nb {\n    z = 2\n}\n");
+    CHECK(update_configuration(cfg) == NULL);
+    CHECK(cfg->pending == NULL);
+    CHECK(!strcmp(get_config_str("a.x"), "cmd"));
+    CHECK(!strcmp(get_config_str("a.y"), "new"));
+    CHECK(!strcmp(get_config_str("b.z"), "2"));
+    CHECK(get_config("c.v") == NULL);
+}
+
+/*
+ * With a prefix, only the variables that have it are used and the rest of
+ * the name becomes the config name. Without one, the name is looked up in
+ * the environment as it is.
+ */
+static void check_env(void) {
+
+    char* envs[] = { "APP_A_B=x", "APP_Server_Port=9", "APP_=empty", "OTHER_A_C=no",
+                     "APP_A_D", "PATH=/bin", NULL };
+    char* argv[] = { "envy", NULL };
+
+    write_config("envy", "a {\n    c = file\n}\nserver {\n    port = 80\n    host = file\n}\n");
+
+    config_t* cfg = init_configuration("envy", "", "");
+    set_config_env_prefix(cfg, "APP_");
+    load_configuration(cfg, 1, argv, envs);
+
+    const char* val = get_config_str("a.b");
+    CHECK(val != NULL && !strcmp(val, "x"));
+    CHECK(get_config_integer("server.port") == 9);
+    CHECK(!strcmp(get_config_str("server.host"), "file"));
+    CHECK(!strcmp(get_config_str("a.c"), "file"));
+    CHECK(get_config("a.d") == NULL);
+    CHECK(get_config("") == NULL);
+    CHECK(get_config("PATH") == NULL);
+    CHECK(get_config("path") == NULL);
+
+    setenv("envy.plain", "yes", 1);
+    cfg = init_configuration("envy", "", "");
+    load_configuration(cfg, 1, argv, envs);
+
+    val = get_config_str("envy.plain");
+    CHECK(val != NULL && !strcmp(val, "yes"));
+    CHECK(get_config("a.b") == NULL);
+    CHECK(!strcmp(get_config_str("server.port"), "80"));
+    unsetenv("envy.plain");
+}
+
+/*
+ * A batch lookup gets the same values as looking the names up one at a
+ * time, including the missing ones, the ones that the environment or
+ * another layer overrides, and the ones with ${} references. There are more
+ * names than fit in one batch.
+ */
+static void check_many(void) {
+
+    char* envs[] = { "MANY_K_NAD=env", "MANY_K_MISS=env", NULL };
+    char* argv[] = { "many", NULL };
+    char text[4096] = "k {\n";
+    const char* names[48];
+    char buf[48][16];
+    string_t* out[48];
+
+    for(int i = 0; i < 36; i++)
+        snprintf(&text[strlen(text)], sizeof(text) - strlen(text), "    n%c%c = %d\n",
+                'a' + i / 26, 'a' + i % 26, i);
+    strcat(text, "    ref = \"<${k.nab}>\"\n    over = file\n}\n");
+    write_config("many", text);
+    write_file("over.cfg", "k {\n    over = layer\n    naf = layer\n}\n");
+
+    config_t* cfg = init_configuration("many", "", "");
+    set_config_env_prefix(cfg, "MANY_");
+    add_config_layer(cfg, "over.cfg", 1);
+    load_configuration(cfg, 1, argv, envs);
+
+    for(int i = 0; i < 40; i++) {
+        snprintf(buf[i], sizeof(buf[i]), "k.n%c%c", 'a' + i / 26, 'a' + i % 26);
+        names[i] = buf[i];
+    }
+    names[40] = "k.ref";
+    names[41] = "k.over";
+    names[42] = "k.miss";
+    names[43] = "none";
+    names[44] = "k.nad";
+    names[45] = "";
+    names[46] = "k.nbj";
+    names[47] = "k.ref";
+
+    get_config_many(cfg, names, out, 48);
+
+    int same = 1;
+    for(int i = 0; i < 48; i++) {
+        string_t* val = get_config(names[i]);
+        if((val == NULL) != (out[i] == NULL) ||
+                (val != NULL && strcmp(raw_string(val), raw_string(out[i]))))
+            same = 0;
+    }
+    CHECK(same);
+    CHECK(out[0] != NULL && !strcmp(raw_string(out[0]), "0"));
+    CHECK(out[3] != NULL && !strcmp(raw_string(out[3]), "env"));
+    CHECK(out[5] != NULL && !strcmp(raw_string(out[5]), "layer"));
+    CHECK(out[35] != NULL && !strcmp(raw_string(out[35]), "35"));
+    CHECK(out[36] == NULL && out[39] == NULL);
+    CHECK(out[40] != NULL && !strcmp(raw_string(out[40]), "<1>"));
+    CHECK(out[41] != NULL && !strcmp(raw_string(out[41]), "layer"));
+    CHECK(out[42] != NULL && !strcmp(raw_string(out[42]), "env"));
+    CHECK(out[43] == NULL && out[45] == NULL);
+    CHECK(out[47] == out[40]);
+}
+
+/*
+ * A snapshot keeps the values that it was taken with through reloads and
+ * overrides, even the ones that were read in place from the cache, while
+ * the live values change. The next snapshot after that has the new values.
+ */
+static void check_snapshot_reload(void) {
+
+    size_t mark = 0;
+    config_entry_t* ent;
+    char names[256] = "";
+
+    write_config("snapold", "s {\n    a = old\n    ref = \"<${s.a}>\"\n    gone = 1\n}\n");
+    load_config("snapold", 0, NULL);
+    config_t* cfg = load_config("snapold", 0, NULL);
+    CHECK(cfg->stats.cache_hit);
+
+    config_snapshot_t* snap = acquire_config_snapshot(cfg);
+    config_snapshot_t* same = acquire_config_snapshot(cfg);
+    CHECK(snap == same);
+    release_config_snapshot(same);
+
+    write_config("snapold", "s {\n    a = new\n    ref = \"<${s.a}>\"\n    added = 2\n}\n");
+    reload_configuration(cfg);
+    add_config(cfg, "s.cmd", create_string("cmd"), CFG_CMD);
+    reload_configuration(cfg);
+
+    CHECK(!strcmp(get_config_str("s.a"), "new"));
+    CHECK(!strcmp(get_config_str("s.ref"), "<new>"));
+    CHECK(get_config("s.gone") == NULL);
+    CHECK(!strcmp(get_snapshot_config(snap, "s.a")->buf, "old"));
+    CHECK(!strcmp(get_snapshot_config(snap, "s.ref")->buf, "<old>"));
+    CHECK(!strcmp(get_snapshot_config(snap, "s.gone")->buf, "1"));
+    CHECK(get_snapshot_config(snap, "s.added") == NULL);
+    CHECK(get_snapshot_config(snap, "s.cmd") == NULL);
+
+    while(NULL != (ent = iter_snapshot_config(snap, &mark)))
+        snprintf(&names[strlen(names)], sizeof(names) - strlen(names), "%s%s",
+                (names[0] != '\0')? " ": "", ent->name);
+    CHECK(!strcmp(names, "s.a s.ref s.gone"));
+    release_config_snapshot(snap);
+
+    snap = acquire_config_snapshot(cfg);
+    CHECK(!strcmp(get_snapshot_config(snap, "s.ref")->buf, "<new>"));
+    CHECK(!strcmp(get_snapshot_config(snap, "s.cmd")->buf, "cmd"));
+    CHECK(get_snapshot_config(snap, "s.gone") == NULL);
+    release_config_snapshot(snap);
+}
+
+/*
+ * A load that attaches to the image that another load published gets the
+ * values without the file being parsed or the cache file being read, but
+ * only when the image was made from the same file. The image can be
+ * published from the parsed table or copied from the cache.
+ */
+static void check_publish(void) {
+
+    char shm[64];
+    char* argv[] = { "pubsub", "--n", "7", NULL };
+    char* args[] = { "pub", NULL };
+
+    snprintf(shm, sizeof(shm), "/confcheck-%d", (int)getpid());
+    write_config("pub", "p {\n    a = 1\n    ref = \"<${p.a}>\"\n}\n");
+    write_config("pubsub", "p {\n    a = other\n}\n");
+
+    config_t* cfg = load_config("pub", 0, NULL);
+    CHECK(!cfg->stats.cache_hit);
+    CHECK(publish_configuration(cfg, shm) == 0);
+    CHECK(remove("pub.cfg.cache") == 0);
+
+    cfg = init_configuration("pub", "", "");
+    set_config_shared(cfg, shm);
+    load_configuration(cfg, 1, args, env);
+    CHECK(cfg->stats.cache_hit);
+    CHECK(access("pub.cfg.cache", F_OK) != 0);
+    CHECK(!strcmp(get_config_str("p.a"), "1"));
+    CHECK(!strcmp(get_config_str("p.ref"), "<1>"));
+
+    // an image of another file is not used
+    cfg = init_configuration("pubsub", "", "");
+    add_cmdline(cfg, 0, "n", "p.n", "", NULL, NULL, CMD_ARGS|CMD_NUM);
+    set_config_shared(cfg, shm);
+    load_configuration(cfg, 3, argv, env);
+    CHECK(!cfg->stats.cache_hit);
+    CHECK(!strcmp(get_config_str("p.a"), "other"));
+    CHECK(get_config_integer("p.n") == 7);
+
+    // the command line is not published
+    CHECK(publish_configuration(cfg, shm) == 0);
+    cfg = init_configuration("pubsub", "", "");
+    set_config_shared(cfg, shm);
+    load_configuration(cfg, 1, argv, env);
+    CHECK(cfg->stats.cache_hit);
+    CHECK(!strcmp(get_config_str("p.a"), "other"));
+    CHECK(get_config("p.n") == NULL);
+
+    // copied from the cache, which is not read once it is published
+    CHECK(publish_configuration(cfg, shm) == 0);
+    CHECK(remove("pubsub.cfg.cache") == 0);
+    cfg = init_configuration("pubsub", "", "");
+    set_config_shared(cfg, shm);
+    load_configuration(cfg, 1, argv, env);
+    CHECK(cfg->stats.cache_hit);
+    CHECK(!strcmp(get_config_str("p.a"), "other"));
+
+    unpublish_configuration(shm);
+    cfg = init_configuration("pub", "", "");
+    set_config_shared(cfg, shm);
+    load_configuration(cfg, 1, args, env);
+    CHECK(!cfg->stats.cache_hit);
+    CHECK(!strcmp(get_config_str("p.ref"), "<1>"));
+}
+
+/*
+ * Iterating goes in the order of the file and then the values that were
+ * added after it, such as the command line. An option that overrides a
+ * value from the file does not move it. An iteration can be picked up from
+ * its mark after values are added or changed.
+ */
+static void check_iter(void) {
+
+    char* argv[] = { "order", "--opt", "o", "--c", "9", NULL };
+    char names[256];
+    size_t mark = 0;
+    config_entry_t* ent;
+    config_t* cfg = NULL;
+
+    write_config("order", "z = 1\nm {\n    b = 2\n    a = 3\n}\nc = 4\n");
+
+    for(int pass = 0; pass < 2; pass++) {
+        cfg = init_configuration("order", "", "");
+        add_cmdline(cfg, 0, "opt", "m.opt", "", NULL, NULL, CMD_ARGS|CMD_STR);
+        add_cmdline(cfg, 0, "c", "c", "", NULL, NULL, CMD_ARGS|CMD_NUM);
+        load_configuration(cfg, 5, argv, env);
+        CHECK(cfg->stats.cache_hit == pass);
+
+        iter_names(cfg, names, sizeof(names));
+        CHECK(!strcmp(names, "z m.b m.a c m.opt"));
+    }
+
+    mark = 0;
+    CHECK(!strcmp(iter_config(cfg, &mark)->name, "z"));
+    CHECK(!strcmp(iter_config(cfg, &mark)->name, "m.b"));
+    add_config(cfg, "late", create_string("l"), CFG_CMD);
+    add_config(cfg, "m.a", create_string("new"), CFG_CMD);
+    add_config(cfg, "z", create_string("new"), CFG_CMD);
+
+    ent = iter_config(cfg, &mark);
+    CHECK(ent != NULL && !strcmp(ent->name, "m.a") && !strcmp(ent->raw->buf, "new"));
+    CHECK(!strcmp(iter_config(cfg, &mark)->name, "c"));
+    CHECK(!strcmp(iter_config(cfg, &mark)->name, "m.opt"));
+    CHECK(!strcmp(iter_config(cfg, &mark)->name, "late"));
+    CHECK(iter_config(cfg, &mark) == NULL);
+
+    // a reload starts over in the order of the new file
+    write_config("order", "c = 5\nz = 6\n");
+    reload_configuration(cfg);
+    iter_names(cfg, names, sizeof(names));
+    CHECK(!strcmp(names, "c z m.a m.opt late"));
+}
+
+int main(int argc, char** argv, char** envp) {
+
+    (void)argc;
+    (void)argv;
+
+    char dir[] = "/tmp/confcheck-XXXXXX";
+    if(mkdtemp(dir) == NULL || chdir(dir)) {
+        fprintf(stderr, "ERROR: Cannot make the scratch directory\n");
+        return 1;
+    }
+
+    // keep the layers in the home directory out of it
+    setenv("HOME", dir, 1);
+    unsetenv("XDG_CONFIG_HOME");
+    env = envp;
+
+    // a lock that is taken twice hangs rather than failing
+    alarm(60);
+
+    check_errors();
+    check_cache();
+    check_reload();
+    check_escapes();
+    check_utf8();
+    check_references();
+    check_update();
+    check_response_files();
+    check_callbacks();
+    check_schema_fields();
+    check_lazy();
+    check_lazy_overrides();
+    check_iter();
+    check_cached_snapshot();
+    check_snapshot_reload();
+    check_layers();
+    check_env();
+    check_many();
+    check_publish();
+    check_watch();
+
+    if(chdir("/") == 0)
+        nftw(dir, remove_path, 16, FTW_DEPTH | FTW_PHYS);
+
+    printf("%d checks, %d failed\n", nchecks, nfailed);
+    return nfailed != 0;
+}
@@ -4,10 +4,17 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "cmdline.h"
 #include "memory.h"
+#include "trace.h"
 
 #define EXPECTED(s) do { \
         fprintf(stderr, "CMDLINE: Expected %s but got '%c'\n\n", (s), get_char()); \
@@ -20,12 +27,28 @@
     } while(0)
 
 
+#define MAX_CMD_FILES 16
+
+// A response file that an "@file" argument named. It is mapped and the
+// arguments are split up in the mapping as they are read.
+typedef struct _cmd_file_t_ {
+    char* base;
+    size_t len;
+    size_t pos;         // where the next argument starts
+    const char* crnt;   // the current argument
+    char* last;         // copy of an argument that ended at the end of the file
+    struct _cmd_file_t_* prev;
+} cmd_file_t;
+
 /*********************************************
  * Private functions
  */
 static const char** cmds = NULL;
 static int cmds_idx = 0;
 static int max_cmds_idx = 0;
+static cmd_file_t* cmd_file = NULL;
+static int cmd_file_depth = 0;
+static const cmdline_entry_t** sort_opts = NULL;
 
 static void show_cmdline_vers(config_t* cfg) {
 
@@ -34,7 +57,7 @@ static void show_cmdline_vers(config_t* cfg) {
 
 static void show_cmdline_help(config_t* cfg) {
 
-    cmdline_entry_t* ptr;
+    const cmdline_entry_t* ptr;
     char tmp[128];
 
     show_cmdline_vers(cfg);
@@ -47,7 +70,8 @@ static void show_cmdline_help(config_t* cfg) {
     memset(tmp, '-', 80);
     printf("%s\n", tmp);
 
-    for(ptr = cfg->cmdline->first; ptr != NULL; ptr = ptr->next) {
+    for(int i = 0; i < cfg->cmdline->nopts; i++) {
+        ptr = cfg->cmdline->opts[i];
         if(ptr->short_opt != 0 || ptr->long_opt != NULL) {
             // this is an actual option.
             if(ptr->short_opt != 0)
@@ -102,88 +126,323 @@ static void init_cmd(int argc, char** argv) {
     cmds = (const char**)argv;
 }
 
+/*
+ * Split the next argument out of the response file, using the same quotes
+ * as the shell. Outside of quotes, white space separates arguments, a '\\'
+ * escapes the next character and a '#' at the start of an argument starts a
+ * comment. The argument is written over the text that it came from, which
+ * is never shorter. Return NULL at the end of the file.
+ */
+static const char* next_file_cmd(cmd_file_t* file) {
+
+    char* buf = file->base;
+    size_t len = file->len;
+    size_t pos = file->pos;
+
+    while(1) {
+        while(pos < len && isspace((unsigned char)buf[pos]))
+            pos++;
+        if(pos < len && buf[pos] == '#') {
+            while(pos < len && buf[pos] != '\n')
+                pos++;
+        }
+        else
+            break;
+    }
+
+    if(pos >= len)
+        return NULL;
+
+    size_t start = pos;
+    size_t out = pos;
+    int quote = 0;
+
+    while(pos < len) {
+        int ch = (unsigned char)buf[pos];
+
+        if(quote == '\'') {
+            if(ch == '\'')
+                quote = 0;
+            else
+                buf[out++] = ch;
+            pos++;
+        }
+        else if(quote == '\"') {
+            if(ch == '\"')
+                quote = 0;
+            else if(ch == '\\' && pos+1 < len && strchr("\"\\$`\n", buf[pos+1]) != NULL) {
+                if(buf[pos+1] != '\n')
+                    buf[out++] = buf[pos+1];
+                pos++;
+            }
+            else
+                buf[out++] = ch;
+            pos++;
+        }
+        else if(isspace(ch))
+            break;
+        else if(ch == '\'' || ch == '\"') {
+            quote = ch;
+            pos++;
+        }
+        else if(ch == '\\' && pos+1 < len) {
+            if(buf[pos+1] != '\n')
+                buf[out++] = buf[pos+1];
+            pos += 2;
+        }
+        else {
+            buf[out++] = ch;
+            pos++;
+        }
+    }
+
+    if(quote != 0) {
+        ERROR("unterminated %c quote in response file", quote);
+        exit(1);
+    }
+
+    file->pos = (pos < len)? pos + 1: pos;
+
+    if(out < len) {
+        buf[out] = '\0';
+        return &buf[start];
+    }
+
+    // there is no room to end it in the mapping
+    _FREE(file->last);
+    file->last = _ALLOC(out - start + 1);
+    memcpy(file->last, &buf[start], out - start);
+    return file->last;
+}
+
+/*
+ * Start reading arguments from the file that an "@file" argument names.
+ * Return non-zero if it cannot be read, in which case the argument is used
+ * as it is, the same as the shell does.
+ */
+static int push_cmd_file(const char* fname) {
+
+    struct stat st;
+    int fd = open(fname, O_RDONLY);
+    if(fd < 0)
+        return 1;
+
+    if(fstat(fd, &st)) {
+        close(fd);
+        return 1;
+    }
+
+    if(cmd_file_depth >= MAX_CMD_FILES) {
+        ERROR("response files are nested too deeply: \"@%s\"", fname);
+        exit(1);
+    }
+
+    // the mapping is private, so splitting the arguments up does not
+    // change the file
+    void* base = NULL;
+    if(st.st_size > 0) {
+        base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if(base == MAP_FAILED) {
+            close(fd);
+            return 1;
+        }
+    }
+    close(fd);
+
+    cmd_file_t* file = _ALLOC_DS(cmd_file_t);
+    file->base = base;
+    file->len = st.st_size;
+    file->pos = 0;
+    file->crnt = NULL;
+    file->last = NULL;
+    file->prev = cmd_file;
+    cmd_file = file;
+    cmd_file_depth++;
+
+    return 0;
+}
+
+static void pop_cmd_file(void) {
+
+    cmd_file_t* file = cmd_file;
+
+    cmd_file = file->prev;
+    cmd_file_depth--;
+    if(file->base != NULL)
+        munmap(file->base, file->len);
+    _FREE(file->last);
+    _FREE(file);
+}
+
 static const char* get_cmd(void) {
 
-    if(cmds_idx >= max_cmds_idx)
+    if(cmd_file != NULL)
+        return cmd_file->crnt;
+    else if(cmds_idx >= max_cmds_idx)
         return NULL;
     else
         return cmds[cmds_idx];
 }
 
+/*
+ * Move to the next argument. An argument like "@file" is replaced by the
+ * arguments in the file, which can name other files. They are read one at a
+ * time as they are consumed, so the whole list is never copied.
+ */
 static const char* consume_cmd(void) {
 
-    if(cmds_idx < max_cmds_idx)
+    if(cmd_file != NULL)
+        cmd_file->crnt = next_file_cmd(cmd_file);
+    else if(cmds_idx < max_cmds_idx)
         cmds_idx++;
 
-    return get_cmd();
+    while(1) {
+        const char* str = get_cmd();
+
+        if(str == NULL && cmd_file != NULL) {
+            pop_cmd_file();
+            if(cmd_file != NULL)
+                cmd_file->crnt = next_file_cmd(cmd_file);
+            else
+                cmds_idx++;
+        }
+        else if(str != NULL && str[0] == '@' && str[1] != '\0' && !push_cmd_file(&str[1])) {
+            cmd_file->crnt = next_file_cmd(cmd_file);
+        }
+        else
+            return str;
+    }
 }
 
 /*
- * Read the list that was created with add_cmdline() and return the option if
- * it exists.
+ * A list option takes an argument even if CMD_ARGS is not set, because a
+ * static table cannot have it added.
  */
-static cmdline_entry_t* get_short_opt(config_t* cfg, int ch) {
+static inline int takes_arg(const cmdline_entry_t* item) {
 
-    cmdline_entry_t* ptr = cfg->cmdline->first;
-    while(ptr != NULL) {
-        if(ptr->short_opt == ch)
-            break;
-        else
-            ptr = ptr->next;
-    }
+    return (item->type & (CMD_ARGS | CMD_LIST)) != 0;
+}
+
+static int comp_long_opt(const void* a, const void* b) {
 
-    return ptr;
+    return strcmp(sort_opts[*(const int*)a]->long_opt, sort_opts[*(const int*)b]->long_opt);
 }
 
 /*
- * Read the list that was created with add_cmdline() and return the option if
- * it exists.
+ * Build the indexes of the options, so that finding one does not depend on
+ * how many of them there are. When an option is given more than once, the
+ * first one wins, the same as a search of the list.
  */
-static cmdline_entry_t* get_long_opt(config_t* cfg, const char* str) {
-
-    cmdline_entry_t* ptr = cfg->cmdline->first;
-    while(ptr != NULL) {
-        if(ptr->long_opt != NULL && !strcmp(str, ptr->long_opt))
-            break;
-        else
-            ptr = ptr->next;
+static void index_cmdline(config_t* cfg) {
+
+    cmdline_t* cmd = cfg->cmdline;
+    const cmdline_entry_t* ptr;
+    int nlongs = 0;
+
+    destroy_cmdline_index(cmd);
+    cmd->longs = create_hash_table();
+    cmd->seen = _ALLOC(cmd->nopts + 1);
+
+    for(int i = 0; i < cmd->nopts; i++) {
+        ptr = cmd->opts[i];
+        if(ptr->short_opt != 0 && cmd->shorts[(unsigned char)ptr->short_opt] == 0)
+            cmd->shorts[(unsigned char)ptr->short_opt] = i + 1;
+        if(ptr->long_opt != NULL && find_table_entry(cmd->longs, ptr->long_opt) == NULL) {
+            add_table_entry(cmd->longs, ptr->long_opt, &cmd->opts[i]);
+            nlongs++;
+        }
+        if(cmd->raw == 0 && ptr->short_opt == 0 && ptr->long_opt == NULL &&
+                    !(ptr->type & CMD_DIV))
+            cmd->raw = i + 1;
     }
 
-    return ptr;
+    cmd->sorted = _ALLOC_ARRAY(int, nlongs + 1);
+    cmd->nsorted = 0;
+    for(int i = 0; i < cmd->nopts; i++)
+        if(cmd->opts[i]->long_opt != NULL &&
+                    find_table_entry(cmd->longs, cmd->opts[i]->long_opt) == &cmd->opts[i])
+            cmd->sorted[cmd->nsorted++] = i;
+
+    sort_opts = cmd->opts;
+    qsort(cmd->sorted, cmd->nsorted, sizeof(int), comp_long_opt);
 }
 
 /*
- * Search the command options for the given name and return the option if it
- * exists. Otherwise return NULL.
+ * Return the position of the option for the character, or -1 if there is
+ * not one.
  */
-static cmdline_entry_t* get_opt_by_name(config_t* cfg, const char* str) {
+static int get_short_opt(config_t* cfg, int ch) {
 
-    cmdline_entry_t* ptr = cfg->cmdline->first;
-    while(ptr != NULL) {
-        if(ptr->name != NULL && !strcmp(str, ptr->name))
-            break;
+    return cfg->cmdline->shorts[(unsigned char)ch] - 1;
+}
+
+/*
+ * Return the position of the long option, or -1 if there is not one. A long
+ * option can be abbreviated to any prefix that only one of them starts with.
+ * A prefix that more than one of them starts with is an error.
+ */
+static int get_long_opt(config_t* cfg, const char* str) {
+
+    cmdline_t* cmd = cfg->cmdline;
+    const cmdline_entry_t** slot = find_table_entry(cmd->longs, str);
+    if(slot != NULL)
+        return slot - cmd->opts;
+    else if(str[0] == '\0')
+        return -1;
+
+    // find the first one that is not less than the prefix
+    size_t len = strlen(str);
+    int lo = 0, hi = cmd->nsorted;
+    while(lo < hi) {
+        int mid = (lo + hi) / 2;
+        if(strcmp(cmd->opts[cmd->sorted[mid]]->long_opt, str) < 0)
+            lo = mid + 1;
         else
-            ptr = ptr->next;
+            hi = mid;
+    }
+
+    if(lo >= cmd->nsorted || strncmp(cmd->opts[cmd->sorted[lo]]->long_opt, str, len))
+        return -1;
+
+    if(lo+1 < cmd->nsorted && !strncmp(cmd->opts[cmd->sorted[lo+1]]->long_opt, str, len)) {
+        ERROR("ambiguous long command option: \"--%s\" could be \"--%s\" or \"--%s\"",
+                    str, cmd->opts[cmd->sorted[lo]]->long_opt,
+                    cmd->opts[cmd->sorted[lo+1]]->long_opt);
+        show_cmdline_help(cfg);
+        exit(1);
     }
 
-    return ptr;
+    return cmd->sorted[lo];
 }
 
 /*
- * Search the command options for the given name and return the option if it
- * exists. Otherwise return NULL.
+ * Return the position of the option that takes the list of files, or -1 if
+ * there is not one.
  */
-static cmdline_entry_t* get_raw_list(config_t* cfg) {
+static int get_raw_list(config_t* cfg) {
 
-    cmdline_entry_t* ptr = cfg->cmdline->first;
-    while(ptr != NULL) {
-        if(ptr->short_opt == 0 && ptr->long_opt == NULL && (!(ptr->type & CMD_DIV)))
-            break;
+    return cfg->cmdline->raw - 1;
+}
+
+/*
+ * Add an option to the end of the ones that are searched.
+ */
+static void append_cmdline_opt(cmdline_t* cmd, const cmdline_entry_t* ptr) {
+
+    if(!(ptr->type & CMD_DIV) && ptr->short_opt == 0 && ptr->long_opt == NULL) {
+        if(ptr->type & CMD_LIST)
+            cmd->files = 2;
         else
-            ptr = ptr->next;
+            cmd->files = 1;
     }
 
-    return ptr;
+    if(cmd->nopts+1 > cmd->capopts) {
+        cmd->capopts = (cmd->capopts > 0)? cmd->capopts << 1: 1 << 4;
+        cmd->opts = _REALLOC_ARRAY(cmd->opts, const cmdline_entry_t*, cmd->capopts);
+    }
+
+    cmd->opts[cmd->nopts] = ptr;
+    cmd->nopts++;
 }
 
 static const char* parm_type_to_str(cmdline_type_t type) {
@@ -197,9 +456,30 @@ static const char* parm_type_to_str(cmdline_type_t type) {
 /*********************************************
  * APIs used by this software.
  */
+
+/*
+ * Free the indexes that were built by parse_cmdline(). They are built again
+ * the next time that it is called.
+ */
+void destroy_cmdline_index(cmdline_t* cmd) {
+
+    if(cmd->longs != NULL)
+        destroy_hash_table(cmd->longs);
+    _FREE(cmd->sorted);
+    _FREE(cmd->seen);
+
+    memset(cmd->shorts, 0, sizeof(cmd->shorts));
+    cmd->raw = 0;
+    cmd->longs = NULL;
+    cmd->sorted = NULL;
+    cmd->nsorted = 0;
+    cmd->seen = NULL;
+}
+
 void destroy_cmdline(cmdline_t* cmd) {
 
     if(cmd != NULL) {
+        destroy_cmdline_index(cmd);
         if(cmd->preamble != NULL)
             _FREE(cmd->preamble);
         if(cmd->vers != NULL)
@@ -222,17 +502,150 @@ void destroy_cmdline(cmdline_t* cmd) {
                 _FREE(crnt);
             }
         }
+        _FREE(cmd->opts);
         _FREE(cmd);
     }
 }
 
 /*
- * Add a parsed command line value to the value database.
+ * Check a number or a bool when it is parsed and keep the converted value in
+ * the entry, so that the typed getters do not have to convert it. Only the
+ * elements of a list are checked. A value that is not valid is an error.
  */
-static void add_cmdline_arg(config_t* cfg, cmdline_entry_t* item, const char* str) {
+static void convert_cmdline_arg(config_t* cfg, const cmdline_entry_t* item,
+                config_entry_t* ent, const char* str) {
+
+    char* end;
+    int conv = 0;
+    long val = 0;
+    double real = 0.0;
+
+    if(item->type & CMD_BOOL) {
+        if(!strcasecmp(str, "true"))
+            val = 1;
+        else if(strcasecmp(str, "false")) {
+            ERROR("command option \"%s\" requires true or false but got \"%s\"",
+                        item->name, str);
+            show_cmdline_help(cfg);
+            exit(1);
+        }
+        real = val;
+        conv = CFG_CONV_INTEGER | CFG_CONV_UNSIGNED | CFG_CONV_FLOAT;
+    }
+    else if(item->type & CMD_NUM) {
+        errno = 0;
+        val = strtol(str, &end, 0);
+        if(end != str && *end == '\0' && errno == 0) {
+            real = val;
+            conv = CFG_CONV_INTEGER | CFG_CONV_FLOAT;
+            if(val >= 0)
+                conv |= CFG_CONV_UNSIGNED;
+        }
+        else {
+            errno = 0;
+            real = strtod(str, &end);
+            if(end == str || *end != '\0' || errno != 0) {
+                ERROR("command option \"%s\" requires a number but got \"%s\"",
+                            item->name, str);
+                show_cmdline_help(cfg);
+                exit(1);
+            }
+            conv = CFG_CONV_FLOAT;
+        }
+    }
 
-    printf("adding: %s = %s\n", item->name, str);
-    // handle dups
+    if(!(item->type & CMD_LIST)) {
+        ent->integer = val;
+        ent->unsig = (unsigned long)val;
+        ent->real = real;
+        ent->conv = conv;
+    }
+}
+
+/*
+ * Add a parsed command line value to the value database. The values are
+ * kept until the whole command line has been parsed. Each value of a list
+ * is appended to the one list for the option, and any other option that is
+ * given more than once keeps the last value. A switch is stored as "true".
+ */
+static void add_cmdline_arg(config_t* cfg, const cmdline_entry_t* item, const char* str) {
+
+    if(item->name == NULL)
+        return;
+
+    cmdline_t* cmd = cfg->cmdline;
+    config_entry_t* ent = find_table_entry(cmd->args, item->name);
+
+    if(str == NULL)
+        str = "true";
+
+    if(ent == NULL) {
+        if(item->type & CMD_LIST) {
+            ent = create_config_entry(item->name, NULL, CFG_CMD | CFG_LIST);
+            ent->values = create_string_list();
+        }
+        else
+            ent = create_config_entry(item->name, NULL, CFG_CMD);
+        add_table_entry(cmd->args, item->name, ent);
+    }
+
+    convert_cmdline_arg(cfg, item, ent, str);
+
+    if(item->type & CMD_LIST)
+        append_string_list(ent->values, create_string(str));
+    else {
+        destroy_string(ent->raw);
+        ent->raw = create_string(str);
+    }
+}
+
+/*
+ * Put the values that were given into the configuration, where they
+ * override the file. The default of an option that was not given goes in a
+ * layer under everything else, so it is only used when nothing else has the
+ * name.
+ */
+static void store_cmdline_args(config_t* cfg) {
+
+    cmdline_t* cmd = cfg->cmdline;
+    hash_table_t* defs = create_hash_table();
+    int ndefs = 0;
+
+    for(int i = 0; i < cmd->nopts; i++) {
+        const cmdline_entry_t* ptr = cmd->opts[i];
+        if(ptr->name == NULL)
+            continue;
+
+        config_entry_t* ent = find_table_entry(cmd->args, ptr->name);
+        if(ent != NULL) {
+            if(ent->values != NULL) {
+                // the text of a list is made once, like an array in the file
+                ent->raw = create_string("[");
+                for(int j = 0; j < ent->values->len; j++) {
+                    if(j > 0)
+                        append_string_str(ent->raw, ", ");
+                    append_string_string(ent->raw, ent->values->list[j]);
+                }
+                append_string_char(ent->raw, ']');
+            }
+            remove_table_entry(cmd->args, ptr->name);
+            add_config_entry(cfg, ent);
+        }
+        else if(ptr->def_val != NULL && !cmd->seen[i] &&
+                    find_table_entry(defs, ptr->name) == NULL) {
+            add_table_entry(defs, ptr->name,
+                        create_config_entry(ptr->name, create_string(ptr->def_val), CFG_CMD));
+            ndefs++;
+        }
+    }
+
+    if(ndefs > 0)
+        add_config_table(cfg, defs, 0);
+    else
+        destroy_hash_table(defs);
+
+    destroy_hash_table(cmd->args);
+    cmd->args = NULL;
 }
 
 /*
@@ -272,24 +685,24 @@ static void parse_short_option(config_t* cfg, const char* str) {
 
     //printf("sstr: %s\n", str);
 
-    cmdline_entry_t* item;
+    const cmdline_entry_t* item;
     int idx = 0;
     int finished = 0;
 
     while(!finished) {
 
-        item = get_short_opt(cfg, str[idx]);
-        if(item != NULL) {
+        int pos = get_short_opt(cfg, str[idx]);
+        if(pos >= 0) {
+            item = cfg->cmdline->opts[pos];
             if(item->cb != NULL) {
                 (*item->cb)(cfg);
                 return;
             }
 
             //printf("setting 'seen' on %s\n", item->name);
-            item->type |= CMD_SEEN;
-            if(item->type & CMD_ARGS) {
+            cfg->cmdline->seen[pos] = 1;
+            if(takes_arg(item)) {
                 if(str[idx+1] == '=' && str[idx+2] != '\0') {
-                    printf("here\n");
                     add_cmdline_arg(cfg, item, &str[idx+2]);
                     consume_cmd();
                     return;
@@ -307,12 +720,14 @@ static void parse_short_option(config_t* cfg, const char* str) {
                         return;
                     }
                     else {
-                        ERROR("short command option \"-%c\" requires argument", str[idx]);
+                        ERROR("short command option \"-%c\" requires argument", item->short_opt);
                         show_cmdline_help(cfg);
                         exit(1);
                     }
                 }
             }
+            else
+                add_cmdline_arg(cfg, item, NULL);
         }
         else {
             ERROR("unknown short command option: \"-%c\"", str[idx]);
@@ -360,9 +775,10 @@ static void parse_long_option(config_t* cfg, const char* str) {
         arg++;
     }
 
-    cmdline_entry_t* item = get_long_opt(cfg, tpt);
+    int pos = get_long_opt(cfg, tpt);
 
-    if(item != NULL) {
+    if(pos >= 0) {
+        const cmdline_entry_t* item = cfg->cmdline->opts[pos];
         if(item->cb != NULL) {
             _FREE(tpt);
             (*item->cb)(cfg);
@@ -370,8 +786,8 @@ static void parse_long_option(config_t* cfg, const char* str) {
         }
 
         //printf("setting 'seen' on %s\n", item->name);
-        item->type |= CMD_SEEN;
-        if(item->type & CMD_ARGS) {
+        cfg->cmdline->seen[pos] = 1;
+        if(takes_arg(item)) {
             if(arg == NULL) {
                 const char* str = consume_cmd();
                 if(str != NULL) {
@@ -398,6 +814,8 @@ static void parse_long_option(config_t* cfg, const char* str) {
                 exit(1);
             }
         }
+        else
+            add_cmdline_arg(cfg, item, NULL);
     }
     else {
         ERROR("unknown long command option: \"--%s\"", tpt);
@@ -422,12 +840,12 @@ static void parse_long_option(config_t* cfg, const char* str) {
  */
 static void parse_list_item(config_t* cfg, const char* str) {
 
-    cmdline_entry_t* item = get_raw_list(cfg);
+    int pos = get_raw_list(cfg);
 
     //printf("rstr: %s\n", str);
-    if(item != NULL) {
-        add_cmdline_arg(cfg, item, str);
-        item->type |= CMD_SEEN;
+    if(pos >= 0) {
+        add_cmdline_arg(cfg, cfg->cmdline->opts[pos], str);
+        cfg->cmdline->seen[pos] = 1;
     }
     else {
         ERROR("unknown option: \"%s\"", str);
@@ -453,7 +871,10 @@ static void parse_list_item(config_t* cfg, const char* str) {
  */
 void parse_cmdline(config_t* cfg, int argc, char** argv) {
 
+    TRACE_BEGIN("cmdline");
     init_cmd(argc, argv);
+    index_cmdline(cfg);
+    cfg->cmdline->args = create_hash_table();
 
     const char* ptr = consume_cmd(); // discard the first element.
 
@@ -475,9 +896,9 @@ void parse_cmdline(config_t* cfg, int argc, char** argv) {
     }
 
     // process the required command options after this.
-    cmdline_entry_t* opt = cfg->cmdline->first;
-    while(opt != NULL) {
-        if(opt->type & CMD_REQD && !(opt->type & CMD_SEEN)) {
+    for(int i = 0; i < cfg->cmdline->nopts; i++) {
+        const cmdline_entry_t* opt = cfg->cmdline->opts[i];
+        if(opt->type & CMD_REQD && !cfg->cmdline->seen[i]) {
             if(opt->long_opt != NULL)
                 ERROR("required command option not found: \"--%s\"", opt->long_opt);
             else if(opt->short_opt != 0)
@@ -488,8 +909,10 @@ void parse_cmdline(config_t* cfg, int argc, char** argv) {
             show_cmdline_help(cfg);
             exit(1);
         }
-        opt = opt->next;
     }
+
+    store_cmdline_args(cfg);
+    TRACE_END("cmdline", argc);
 }
 
 
@@ -512,6 +935,9 @@ void init_cmdline(config_t* cfg, const char* name, const char* preamble,
     cfg->cmdline->files = 0;
     cfg->cmdline->first = NULL;
     cfg->cmdline->last = NULL;
+    cfg->cmdline->opts = NULL;
+    cfg->cmdline->nopts = 0;
+    cfg->cmdline->capopts = 0;
 }
 
 void add_cmdline(config_t* cfg, int short_opt, const char* long_opt,
@@ -520,13 +946,6 @@ void add_cmdline(config_t* cfg, int short_opt, const char* long_opt,
 
     cmdline_entry_t* ptr = _ALLOC_DS(cmdline_entry_t);
 
-    if(!(type & CMD_DIV) && short_opt == 0 && long_opt == NULL) {
-        if(type & CMD_LIST)
-            cfg->cmdline->files = 2;
-        else
-            cfg->cmdline->files = 1;
-    }
-
     if(long_opt != NULL)
         ptr->long_opt = _DUP_STR(long_opt);
     else
@@ -561,6 +980,21 @@ void add_cmdline(config_t* cfg, int short_opt, const char* long_opt,
     else
         cfg->cmdline->first = ptr;
     cfg->cmdline->last = ptr;
+
+    append_cmdline_opt(cfg->cmdline, ptr);
+}
+
+/*
+ * Add all of the options in a table that ends with CMDLINE_END. Nothing is
+ * copied, so the table must not change while the configuration is in use,
+ * which is what a static const one is for. Options can be added with this
+ * and with add_cmdline() in any order.
+ */
+void add_cmdline_table(config_t* cfg, const cmdline_entry_t* table) {
+
+    for(const cmdline_entry_t* ptr = table; ptr->short_opt != 0 || ptr->long_opt != NULL ||
+                ptr->name != NULL || ptr->help != NULL || ptr->type != CMD_NONE; ptr++)
+        append_cmdline_opt(cfg->cmdline, ptr);
 }
 
 void cb_cmdline_help(config_t* cfg) {
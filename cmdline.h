@@ -5,6 +5,7 @@
 #define _CMDLINE_H_
 
 #include "config.h"
+#include "hash.h"
 
 typedef enum {
     // place holder
@@ -30,7 +31,8 @@ typedef enum {
 typedef void (*cmdline_callback_t)(config_t*);
 
 // This is for options only. The values are stored in the config data
-// structure. It's only used when parsing the command line.
+// structure. It's only used when parsing the command line. A table of them
+// for add_cmdline_table() can be static const, and ends with CMDLINE_END.
 typedef struct _cmdline_entry_t_ {
     int short_opt;
     const char* long_opt;
@@ -42,13 +44,31 @@ typedef struct _cmdline_entry_t_ {
     struct _cmdline_entry_t_* next;
 } cmdline_entry_t;
 
+#define CMDLINE_END { 0, NULL, NULL, NULL, NULL, NULL, CMD_NONE, NULL }
+
 typedef struct _cmdline_t_ {
     const char* preamble;
     const char* vers;
     const char* name;
     int files;
-    struct _cmdline_entry_t_* first;
+    struct _cmdline_entry_t_* first;    // the ones that add_cmdline() made
     struct _cmdline_entry_t_* last;
+
+    // every option in the order that it was added, including the ones in
+    // the tables given to add_cmdline_table()
+    const struct _cmdline_entry_t_** opts;
+    int nopts;
+    int capopts;
+
+    // indexes of the options, built when the command line is parsed
+    int shorts[256];            // position in opts plus one
+    int raw;                    // the one that takes the file list, plus one
+    hash_table_t* longs;        // of pointers into opts
+    int* sorted;                // positions, by long option, for abbreviations
+    int nsorted;
+    unsigned char* seen;        // the options that were given
+
+    hash_table_t* args;         // the values that were given, by name
 } cmdline_t;
 
 void init_cmdline(config_t* cfg,
@@ -63,8 +83,10 @@ void add_cmdline(config_t* cfg,
                 const char* def_val,
                 cmdline_callback_t cb,
                 cmdline_type_t type);
+void add_cmdline_table(config_t* cfg, const cmdline_entry_t* table);
 
 void destroy_cmdline(cmdline_t* cmd);
+void destroy_cmdline_index(cmdline_t* cmd);
 void parse_cmdline(config_t* cfg, int argc, char** argv);
 
 void cb_cmdline_help(config_t* cfg);
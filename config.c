@@ -5,64 +5,1771 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <errno.h>
 
 #include <assert.h>
+#include <limits.h>
 
 #include "parse_file.h"
+#include "scan_file.h"
+#include "cache_file.h"
+#include "cmdline.h"
+#include "schema.h"
 #include "memory.h"
+#include "trace.h"
 #include "config.h"
 
+static config_t* config = NULL;
+
+/*
+ * Free a table that belonged to a configuration. Only the CFG_FILE entries
+ * belong to the table. Others are shared with the table that replaced it.
+ */
+static void destroy_config_table(hash_table_t* tab) {
+
+    for(size_t slot = 0; slot < tab->cap; slot++) {
+        for(hash_entry_t* crnt = tab->table[slot]; crnt != NULL; crnt = crnt->next) {
+            config_entry_t* ent = (config_entry_t*)crnt->val;
+            if(ent != NULL && (ent->type & CFG_FILE))
+                destroy_config_entry(ent);
+        }
+    }
+
+    destroy_hash_table(tab);
+}
+
+/*
+ * Free the replaced tables if there are no readers that could still be
+ * looking at one of them. A reader that starts after the check can only see
+ * the current table. Snapshots that have been released are freed too, and
+ * anything that was retired after the oldest snapshot that is still held
+ * was taken is kept, because that snapshot can still see it. Must be called
+ * with the lock held.
+ */
+static void reclaim_config(config_t* cfg) {
+
+    if(__atomic_load_n(&cfg->readers, __ATOMIC_SEQ_CST) != 0)
+        return;
+
+    unsigned long oldest = ULONG_MAX;
+    config_snapshot_t** ptr = &cfg->snapshots;
+    while(*ptr != NULL) {
+        config_snapshot_t* snap = *ptr;
+        if(__atomic_load_n(&snap->refs, __ATOMIC_SEQ_CST) == 0) {
+            *ptr = snap->next;
+            destroy_hash_table(snap->vars);
+            _FREE(snap);
+        }
+        else {
+            if(snap->epoch < oldest)
+                oldest = snap->epoch;
+            ptr = &snap->next;
+        }
+    }
+
+    config_retired_t* crnt = __atomic_exchange_n(&cfg->retired, NULL, __ATOMIC_SEQ_CST);
+    config_retired_t* pinned = cfg->pinned;
+    config_retired_t* dead = NULL;
+    config_retired_t* next;
+    cfg->pinned = NULL;
+
+    for(; crnt != NULL || pinned != NULL; crnt = next) {
+        if(crnt == NULL) {
+            crnt = pinned;
+            pinned = NULL;
+        }
+        next = crnt->next;
+
+        if(crnt->epoch > oldest) {
+            crnt->next = cfg->pinned;
+            cfg->pinned = crnt;
+        }
+        else {
+            crnt->next = dead;
+            dead = crnt;
+        }
+    }
+
+    // a table can still point at an entry that was retired after it, so
+    // the tables have to go before the entries
+    for(crnt = dead; crnt != NULL; crnt = crnt->next) {
+        if(crnt->vars != NULL) {
+            if(crnt->shared)
+                destroy_hash_table(crnt->vars);
+            else
+                destroy_config_table(crnt->vars);
+        }
+    }
+
+    for(crnt = dead; crnt != NULL; crnt = next) {
+        next = crnt->next;
+        close_config_cache(crnt->cache);
+        destroy_config_entry(crnt->entry);
+        _FREE(crnt);
+    }
+}
+
+/*
+ * Put something that was replaced on the list to be freed when there are no
+ * readers. This does not need the lock, so that readers can retire the
+ * expanded values that they replace.
+ */
+static void retire_config(config_t* cfg, hash_table_t* vars, int shared,
+                struct _config_cache_t_* cache, config_entry_t* entry) {
+
+    config_retired_t* ret = _ALLOC_DS(config_retired_t);
+    ret->vars = vars;
+    ret->shared = shared;
+    ret->cache = cache;
+    ret->entry = entry;
+    ret->epoch = __atomic_add_fetch(&cfg->epoch, 1, __ATOMIC_SEQ_CST);
+    ret->next = __atomic_load_n(&cfg->retired, __ATOMIC_SEQ_CST);
+
+    while(!__atomic_compare_exchange_n(&cfg->retired, &ret->next, ret, 0,
+                __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+        ;
+}
+
+/*
+ * The reader count keeps a table that is replaced by a reload from being
+ * freed while it is being searched. Anything taken from an entry must be
+ * taken before leave_config() is called.
+ */
+static void enter_config(config_t* cfg) {
+
+    __atomic_add_fetch(&cfg->readers, 1, __ATOMIC_SEQ_CST);
+}
+
+static void leave_config(config_t* cfg) {
+
+    if(__atomic_sub_fetch(&cfg->readers, 1, __ATOMIC_SEQ_CST) == 0 &&
+                __atomic_load_n(&cfg->retired, __ATOMIC_SEQ_CST) != NULL &&
+                !pthread_mutex_trylock(&cfg->lock)) {
+        reclaim_config(cfg);
+        pthread_mutex_unlock(&cfg->lock);
+    }
+}
+
+/*
+ * Call the reload callbacks. They are called after the lock is let go,
+ * because looking a value up can take it. The caller entered the
+ * configuration as a reader before it replaced anything, so nothing that
+ * was replaced is freed until the callbacks return, and this leaves it. The
+ * callbacks of one reload are finished before the ones of the next start.
+ */
+static void call_reload_callbacks(config_t* cfg, config_changes_t* changes) {
+
+    pthread_mutex_lock(&cfg->notify);
+    cfg->changes = changes;
+    for(int i = 0; i < cfg->reload_len; i++)
+        (*cfg->reload_cbs[i])(cfg);
+    cfg->changes = NULL;
+    pthread_mutex_unlock(&cfg->notify);
+
+    leave_config(cfg);
+}
+
+/*
+ * The values have changed, so the current snapshot and the expanded values
+ * are out of date. The next snapshot that is acquired is made from the new
+ * values. Must be called with the lock held, after the change.
+ */
+static void mark_config_changed(config_t* cfg) {
+
+    config_snapshot_t* snap = cfg->snapshot;
+    __atomic_add_fetch(&cfg->generation, 1, __ATOMIC_SEQ_CST);
+
+    if(snap != NULL) {
+        __atomic_store_n(&cfg->snapshot, NULL, __ATOMIC_SEQ_CST);
+        __atomic_sub_fetch(&snap->refs, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+static void add_config_change(config_changes_t* changes, const char* name,
+                config_change_type_t type) {
+
+    if(changes == NULL)
+        return;
+
+    if(changes->len+1 > changes->cap) {
+        changes->cap <<= 1;
+        changes->list = _REALLOC_ARRAY(changes->list, config_change_t, changes->cap);
+    }
+
+    changes->list[changes->len].name = _DUP_STR(name);
+    changes->list[changes->len].type = type;
+    changes->len++;
+}
+
+/*
+ * Return non-zero if the text has a ${name} reference to one of the names
+ * in the table. The references are found the same way as expand_value().
+ */
+static int refers_to_names(const char* text, hash_table_t* names) {
+
+    const char* end;
+    int found = 0;
+
+    while(!found && NULL != (text = strstr(text, "${")) &&
+                NULL != (end = strchr(&text[2], '}'))) {
+        size_t len = end - &text[2];
+        char* name = _ALLOC(len + 1);
+        memcpy(name, &text[2], len);
+        found = (find_table_entry(names, name) != NULL);
+        _FREE(name);
+        text = &end[1];
+    }
+
+    return found;
+}
+
+/*
+ * A value with ${} references changes when a value that it refers to
+ * changes, even if its own text did not. Add those to the changes as
+ * updated, and then the ones that refer to them, until there are no more.
+ */
+static void add_dependent_changes(hash_table_t* vars, config_changes_t* changes) {
+
+    hash_table_t* names = create_hash_table();
+    for(int i = 0; i < changes->len; i++)
+        add_table_entry(names, changes->list[i].name, (void*)changes->list[i].name);
+
+    for(int more = 1; more; ) {
+        more = 0;
+
+        size_t mark = 0;
+        const char* key;
+        config_entry_t* ent;
+        while(NULL != (ent = iter_table_entry(vars, &mark, &key))) {
+            if(!(ent->type & CFG_FILE) || ent->values != NULL ||
+                        find_table_entry(names, key) != NULL ||
+                        !refers_to_names(raw_string(ent->raw), names))
+                continue;
+
+            add_config_change(changes, key, CFG_UPDATED);
+            add_table_entry(names, key, (void*)key);
+            more = 1;
+        }
+    }
+
+    destroy_hash_table(names);
+}
+
+/*
+ * Remove a key that came from the file from the live table. Keys that were
+ * overridden by the environment or command line are left alone.
+ */
+static void remove_file_key(config_t* cfg, hash_table_t* vars, const char* key,
+                config_changes_t* changes) {
+
+    config_entry_t* ent = find_table_entry(vars, key);
+
+    if(ent != NULL && (ent->type & CFG_FILE)) {
+        replace_table_entry(vars, key, NULL, NULL);
+        retire_config(cfg, NULL, 0, NULL, ent);
+        add_config_change(changes, key, CFG_REMOVED);
+    }
+}
+
+/*
+ * Put the values from a section that was parsed into its own table into
+ * the live table. Only values that are new or different are changed. The
+ * changes can be NULL if they are not wanted.
+ */
+static void apply_file_keys(config_t* cfg, hash_table_t* vars, hash_table_t* tab,
+                string_list_t* keys, config_changes_t* changes) {
+
+    for(int i = 0; i < keys->len; i++) {
+        const char* key = raw_string(keys->list[i]);
+        config_entry_t* ent = find_table_entry(tab, key);
+        config_entry_t* old = find_table_entry(vars, key);
+
+        if(old == NULL) {
+            // the key may still be there from when it was removed
+            if(!replace_table_entry(vars, key, ent, NULL))
+                add_table_entry(vars, key, ent);
+            add_config_change(changes, key, CFG_ADDED);
+        }
+        else if(!(old->type & CFG_FILE) || (!comp_string(old->raw, ent->raw) &&
+                    (old->values == NULL) == (ent->values == NULL))) {
+            // overridden or not changed, so keep the one that is there
+            destroy_config_entry(ent);
+        }
+        else {
+            replace_table_entry(vars, key, ent, NULL);
+            retire_config(cfg, NULL, 0, NULL, old);
+            add_config_change(changes, key, CFG_UPDATED);
+        }
+    }
+}
+
+/*
+ * Put an entry into the live table, replacing the one that has the name if
+ * there is one. If the table is full then a bigger copy is swapped in, so
+ * readers are never blocked. Must be called with the lock held. Returns
+ * non-zero if it replaced a value.
+ */
+static int insert_config_entry(config_t* cfg, const char* name, config_entry_t* ent) {
+
+    hash_table_t* vars = cfg->vars;
+    config_entry_t* old = NULL;
+
+    if(replace_table_entry(vars, name, ent, (void**)&old)) {
+        if(old != NULL)
+            retire_config(cfg, NULL, 0, NULL, old);
+        return old != NULL;
+    }
+
+    if(!table_has_room(vars, 1))
+        vars = copy_hash_table(vars, 1);
+
+    add_table_entry(vars, name, ent);
+
+    if(vars != cfg->vars) {
+        retire_config(cfg, cfg->vars, 1, NULL, NULL);
+        __atomic_store_n(&cfg->vars, vars, __ATOMIC_SEQ_CST);
+    }
+
+    return 0;
+}
+
 config_t* init_configuration(const char* name, const char* pre, const char* vers) {
 
-    config_t* cfg = _ALLOC_DS(config_t);
-    cfg->vars = create_hash_table();
+    config_t* cfg = _ALLOC_DS(config_t);
+    cfg->vars = create_hash_table();
+    pthread_mutex_init(&cfg->lock, NULL);
+    pthread_mutex_init(&cfg->notify, NULL);
+    config = cfg;
+
+    init_cmdline(cfg, name, pre, vers);
+
+    return cfg;
+}
+
+/*
+ * Load the configuration and return the statistics of the load. They stay
+ * valid as long as the configuration does. The scanner and the parser add
+ * to them through set_load_stats() while this is running.
+ */
+const config_load_stats_t* load_configuration(config_t* cfg, int argc, char** argv, char** envp) {
+
+    TRACE_BEGIN("load");
+    config_load_stats_t* stats = &cfg->stats;
+    config_load_stats_t* prev = set_load_stats(stats);
+    size_t allocs = mem_alloc_count();
+    uint64_t start = get_trace_time();
+    uint64_t now;
+
+    int utf8 = set_utf8_check(cfg->utf8);
+    cfg->pname = _DUP_STR(argv[0]);
+    cfg->fname = find_config_file(cfg);
+    find_config_layers(cfg);
+    now = get_trace_time();
+    stats->find_ns = now - start;
+
+    // use the compiled form of the file if it is still good, from shared
+    // memory or next to the file, otherwise parse the text and compile it
+    // for the next time. A lazy load does not have all of the values to
+    // compile.
+    if(!cfg->lazy) {
+        TRACE_BEGIN("cache_open");
+        if(cfg->shared != NULL)
+            cfg->cache = attach_config_cache(cfg->shared, cfg->fname);
+        if(cfg->cache == NULL)
+            cfg->cache = open_config_cache(cfg->fname);
+        stats->cache_hit = (cfg->cache != NULL);
+        stats->cache_ns = get_trace_time() - now;
+        TRACE_END("cache_open", cfg->cache != NULL);
+    }
+    if(cfg->cache == NULL) {
+        load_config_file(cfg);
+        if(!cfg->lazy) {
+            TRACE_BEGIN("cache_save");
+            now = get_trace_time();
+            save_config_cache(cfg->fname, cfg->vars);
+            stats->cache_ns += get_trace_time() - now;
+            TRACE_END("cache_save", cfg->vars->len);
+        }
+    }
+
+    // the environment is not read until a name is looked up
+    cfg->envp = envp;
+
+    now = get_trace_time();
+    parse_cmdline(cfg, argc, argv);
+    stats->cmdline_ns = get_trace_time() - now;
+
+    if(cfg->schema != NULL)
+        fill_config_schema(cfg);
+
+    stats->total_ns = get_trace_time() - start;
+    stats->allocs = mem_alloc_count() - allocs;
+    set_load_stats(prev);
+    set_utf8_check(utf8);
+    TRACE_END("load", 0);
+
+    return stats;
+}
+
+/*
+ * Re-read the configuration file into a fresh table and make it the current
+ * one. Entries that did not come from the file are carried over so they
+ * still override it. The reload callbacks are called after the new table is
+ * live and the old one is freed after the last reader is finished with it.
+ * If the file has errors they are printed as warnings and the current
+ * configuration is kept. The callbacks are only called if notify is set.
+ */
+static void reload_config(config_t* cfg, int notify) {
+
+    if(cfg->fname == NULL)
+        return;
+
+    section_list_t* secs;
+    hash_table_t* fresh = create_hash_table();
+    config_errors_t* errs = create_error_list();
+    config_errors_t* prev = set_error_list(errs);
+    int utf8 = set_utf8_check(cfg->utf8);
+    parse_config_file(cfg->fname, fresh, &secs);
+    set_utf8_check(utf8);
+    set_error_list(prev);
+
+    if(errs->len > 0) {
+        print_error_list(errs, "WARNING");
+        destroy_error_list(errs);
+        destroy_config_table(fresh);
+        destroy_section_list(secs);
+        return;
+    }
+
+    destroy_error_list(errs);
+    save_config_cache(cfg->fname, fresh);
+
+    pthread_mutex_lock(&cfg->lock);
+    if(notify)
+        enter_config(cfg);
+
+    // an override keeps the place of the value from the file, the same as
+    // when the file is loaded
+    hash_table_t* old = cfg->vars;
+    size_t mark = 0;
+    const char* key;
+    config_entry_t* ent;
+    config_entry_t* file;
+    while(NULL != (ent = iter_table_entry(old, &mark, &key)))
+        if(!(ent->type & CFG_FILE)) {
+            if(replace_table_entry(fresh, key, ent, (void**)&file))
+                destroy_config_entry(file);
+            else
+                add_table_entry(fresh, key, ent);
+        }
+
+    retire_config(cfg, old, 0, (cfg->cache != NULL)? cfg->cache: cfg->image, NULL);
+    cfg->image = NULL;
+    destroy_section_list(cfg->sections);
+    cfg->sections = secs;
+
+    // the table has everything from the file so the cache and the sections
+    // that were not parsed are not needed. The table has to go in first,
+    // see find_config_entry().
+    __atomic_store_n(&cfg->vars, fresh, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&cfg->cache, NULL, __ATOMIC_SEQ_CST);
+    if(cfg->pending != NULL) {
+        retire_config(cfg, cfg->pending, 1, NULL, NULL);
+        __atomic_store_n(&cfg->pending, NULL, __ATOMIC_SEQ_CST);
+        cfg->npending = 0;
+        _FREE(cfg->text);
+    }
+    cfg->unordered = 0;
+    mark_config_changed(cfg);
+
+    reclaim_config(cfg);
+    pthread_mutex_unlock(&cfg->lock);
+
+    if(notify)
+        call_reload_callbacks(cfg, NULL);
+}
+
+void reload_configuration(config_t* cfg) {
+
+    reload_config(cfg, 1);
+}
+
+/*
+ * Read the text of the main file for an update. If it cannot be read, or it
+ * is checked and is not valid UTF-8, a warning is printed and NULL is
+ * returned.
+ */
+static char* read_config_text(config_t* cfg, size_t* len) {
+
+    config_errors_t* errs = create_error_list();
+    config_errors_t* prev = set_error_list(errs);
+    int utf8 = set_utf8_check(cfg->utf8);
+    char* text = read_input_file(cfg->fname, len);
+    set_utf8_check(utf8);
+    set_error_list(prev);
+
+    if(text == NULL)
+        fprintf(stderr, "WARNING: Cannot read configuration file: %s: %s\n",
+                    cfg->fname, strerror(errno));
+    else if(errs->len > 0) {
+        print_error_list(errs, "WARNING");
+        _FREE(text);
+        text = NULL;
+    }
+
+    destroy_error_list(errs);
+    return text;
+}
+
+/*
+ * Re-read the configuration file, but only parse the top level sections
+ * whose text has changed, and make the fewest changes to the live table.
+ * Entries are replaced in place, so readers are never blocked. If so many
+ * keys were added that the table would have to grow, a copy is made and
+ * swapped in the same way as reload_configuration(). The reload callbacks
+ * can see the changes in cfg->changes.
+ *
+ * Return the list of changes, which the caller must destroy. A value whose
+ * ${} references lead to a value that changed is in the list as updated.
+ * When the sections of the file are not known, such as when it was loaded
+ * from the cache, or the file has more than one section with the same name,
+ * or some sections of a lazy load have not been parsed yet, the whole file
+ * is reloaded instead and NULL is returned. NULL is also returned, and
+ * nothing is changed, when the file cannot be read, is checked and is not
+ * valid UTF-8, or a changed section has errors.
+ */
+config_changes_t* update_configuration(config_t* cfg) {
+
+    if(cfg->fname == NULL)
+        return NULL;
+
+    size_t len;
+    char* text = read_config_text(cfg, &len);
+    if(text == NULL)
+        return NULL;
+
+    pthread_mutex_lock(&cfg->lock);
+
+    section_list_t* secs = create_section_list();
+    hash_table_t* index = create_hash_table();
+    int full = (cfg->cache != NULL || cfg->pending != NULL || cfg->sections == NULL ||
+                find_sections(text, len, secs));
+
+    // the sections are matched up by name
+    for(int i = 0; !full && i < cfg->sections->len; i++) {
+        config_section_t* sec = &cfg->sections->list[i];
+        if(find_table_entry(index, sec->name) != NULL)
+            full++;
+        else
+            add_table_entry(index, sec->name, sec);
+    }
+
+    for(int i = 0; !full && i < secs->len; i++)
+        for(int j = i + 1; !full && j < secs->len; j++)
+            if(!strcmp(secs->list[i].name, secs->list[j].name))
+                full++;
+
+    if(full) {
+        destroy_hash_table(index);
+        destroy_section_list(secs);
+        _FREE(text);
+        pthread_mutex_unlock(&cfg->lock);
+        reload_configuration(cfg);
+        return NULL;
+    }
+
+    // parse the sections that changed into their own tables and count the
+    // keys that are not in the live table yet. Until the callbacks are done
+    // this is a reader, so what is replaced is not freed under them.
+    enter_config(cfg);
+    hash_table_t* vars = cfg->vars;
+    hash_table_t** parsed = _ALLOC_ARRAY(hash_table_t*, secs->len);
+    config_section_t** prev = _ALLOC_ARRAY(config_section_t*, secs->len);
+    config_errors_t* errs = create_error_list();
+    config_errors_t* perrs = set_error_list(errs);
+    size_t added = 0;
+
+    for(int i = 0; i < secs->len; i++) {
+        config_section_t* sec = &secs->list[i];
+        prev[i] = find_table_entry(index, sec->name);
+
+        if(prev[i] == NULL || prev[i]->hash != sec->hash) {
+            parsed[i] = create_hash_table();
+            parse_config_section(cfg->fname, text, sec, parsed[i]);
+            for(int k = 0; k < sec->keys->len; k++)
+                if(find_table_entry(vars, raw_string(sec->keys->list[k])) == NULL)
+                    added++;
+        }
+    }
+
+    set_error_list(perrs);
+    if(errs->len > 0) {
+        print_error_list(errs, "WARNING");
+        for(int i = 0; i < secs->len; i++)
+            if(parsed[i] != NULL)
+                destroy_config_table(parsed[i]);
+        pthread_mutex_unlock(&cfg->lock);
+        leave_config(cfg);
+
+        destroy_error_list(errs);
+        _FREE(parsed);
+        _FREE(prev);
+        destroy_hash_table(index);
+        destroy_section_list(secs);
+        _FREE(text);
+        return NULL;
+    }
+    destroy_error_list(errs);
+
+    for(int i = 0; i < secs->len; i++) {
+        if(prev[i] == NULL)
+            continue;
+
+        if(parsed[i] == NULL) {
+            secs->list[i].keys = prev[i]->keys;
+            prev[i]->keys = NULL;
+        }
+
+        // what is left in the index are the sections that were deleted
+        replace_table_entry(index, secs->list[i].name, NULL, NULL);
+    }
+
+    if(!table_has_room(vars, added))
+        vars = copy_hash_table(vars, added);
+
+    config_changes_t* changes = _ALLOC_DS(config_changes_t);
+    changes->cap = 1 << 3;
+    changes->list = _ALLOC_ARRAY(config_change_t, changes->cap);
+
+    for(int i = 0; i < cfg->sections->len; i++) {
+        config_section_t* old = &cfg->sections->list[i];
+        if(find_table_entry(index, old->name) != NULL)
+            for(int k = 0; k < old->keys->len; k++)
+                remove_file_key(cfg, vars, raw_string(old->keys->list[k]), changes);
+    }
+
+    for(int i = 0; i < secs->len; i++) {
+        if(parsed[i] == NULL)
+            continue;
+
+        if(prev[i] != NULL) {
+            string_list_t* keys = prev[i]->keys;
+            for(int k = 0; k < keys->len; k++)
+                if(find_table_entry(parsed[i], raw_string(keys->list[k])) == NULL)
+                    remove_file_key(cfg, vars, raw_string(keys->list[k]), changes);
+        }
+
+        apply_file_keys(cfg, vars, parsed[i], secs->list[i].keys, changes);
+        destroy_hash_table(parsed[i]);
+    }
+
+    if(vars != cfg->vars) {
+        retire_config(cfg, cfg->vars, 1, NULL, NULL);
+        __atomic_store_n(&cfg->vars, vars, __ATOMIC_SEQ_CST);
+    }
+
+    destroy_section_list(cfg->sections);
+    cfg->sections = secs;
+
+    if(changes->len > 0) {
+        add_dependent_changes(vars, changes);
+        mark_config_changed(cfg);
+    }
+
+    reclaim_config(cfg);
+    pthread_mutex_unlock(&cfg->lock);
+
+    call_reload_callbacks(cfg, changes);
+
+    _FREE(parsed);
+    _FREE(prev);
+    destroy_hash_table(index);
+    _FREE(text);
+
+    return changes;
+}
+
+/*
+ * Free a list of changes that was returned by update_configuration().
+ */
+void destroy_config_changes(config_changes_t* changes) {
+
+    if(changes != NULL) {
+        for(int i = 0; i < changes->len; i++)
+            _FREE(changes->list[i].name);
+        _FREE(changes->list);
+        _FREE(changes);
+    }
+}
+
+/*
+ * Register a function to be called after the configuration was reloaded.
+ * Pointers that were returned by get_config() before the reload must not be
+ * used after the callback returns. The callback can look values up, but it
+ * must not reload the configuration or register another callback.
+ */
+void add_config_reload(config_t* cfg, config_reload_cb_t cb) {
+
+    pthread_mutex_lock(&cfg->notify);
+
+    if(cfg->reload_len+1 > cfg->reload_cap) {
+        cfg->reload_cap = (cfg->reload_cap)? cfg->reload_cap << 1: 1 << 3;
+        cfg->reload_cbs = _REALLOC_ARRAY(cfg->reload_cbs, config_reload_cb_t, cfg->reload_cap);
+    }
+
+    cfg->reload_cbs[cfg->reload_len] = cb;
+    cfg->reload_len++;
+
+    pthread_mutex_unlock(&cfg->notify);
+}
+
+/*
+ * Create a config entry. The string becomes the property of the entry.
+ */
+config_entry_t* create_config_entry(const char* name, string_t* str, config_entry_type_t type) {
+
+    config_entry_t* ent = _ALLOC_DS(config_entry_t);
+    ent->name = _DUP_STR(name);
+    ent->type = type;
+    ent->raw = str;
+    ent->values = NULL;
+
+    return ent;
+}
+
+/*
+ * Free the memory associated with a config entry.
+ */
+void destroy_config_entry(config_entry_t* ent) {
+
+    if(ent != NULL) {
+        _FREE(ent->name);
+        destroy_string(ent->raw);
+        destroy_string_list(ent->values);
+        destroy_config_entry(ent->expanded);
+        _FREE(ent);
+    }
+}
+
+/*
+ * When lazy is set, load_configuration() only divides the file into its top
+ * level sections, and a section is parsed the first time that one of its
+ * names is looked up. Must be called before load_configuration().
+ */
+void set_config_lazy(config_t* cfg, int lazy) {
+
+    cfg->lazy = lazy;
+}
+
+/*
+ * When on is set, the configuration files are checked for text that is not
+ * valid UTF-8 when they are read, and the line and column of the first bad
+ * sequence is reported as an error. Must be called before
+ * load_configuration().
+ */
+void set_config_utf8(config_t* cfg, int on) {
+
+    cfg->utf8 = on;
+}
+
+/*
+ * Only use the environment variables that start with the prefix, such as
+ * "MYAPP_". The rest of the variable name is lower cased and the '_' are
+ * changed to '.' to make the config name, so MYAPP_BACON_NUMBER is
+ * bacon.number. Without a prefix, a name is looked up in the environment as
+ * it is. Must be called before load_configuration().
+ */
+void set_config_env_prefix(config_t* cfg, const char* prefix) {
+
+    _FREE(cfg->env_prefix);
+    cfg->env_prefix = (prefix != NULL)? _DUP_STR(prefix): NULL;
+}
+
+/*
+ * Look the values of the file up in the image that another process put into
+ * the shared memory object with publish_configuration(), such as "/myapp".
+ * If it is not there or was made from a different file, then the file is
+ * loaded as usual. Must be called before load_configuration().
+ */
+void set_config_shared(config_t* cfg, const char* name) {
+
+    _FREE(cfg->shared);
+    cfg->shared = (name != NULL)? _DUP_STR(name): NULL;
+}
+
+/*
+ * Put an image of the values from the file into a shared memory object, so
+ * that processes that call set_config_shared() with the same name do not
+ * parse the file themselves. The other values are not published. Return
+ * non-zero if it could not be published.
+ */
+int publish_configuration(config_t* cfg, const char* name) {
+
+    if(cfg->fname == NULL || cfg->pending != NULL) {
+        fprintf(stderr, "WARNING: Cannot publish configuration: %s: %s\n", name,
+                    (cfg->fname == NULL)? "there is no file": "it is not all parsed");
+        return 1;
+    }
+
+    pthread_mutex_lock(&cfg->lock);
+    int err = publish_config_cache(name, cfg->fname, cfg->vars,
+                (cfg->cache != NULL)? cfg->cache: cfg->image);
+    pthread_mutex_unlock(&cfg->lock);
+
+    return err;
+}
+
+/*
+ * Remove the shared memory object. Processes that are using it keep it until
+ * they reload or exit.
+ */
+void unpublish_configuration(const char* name) {
+
+    unpublish_config_cache(name);
+}
+
+/*
+ * Add a value to the configuration. If the name already exists then the new
+ * value replaces it.
+ */
+void add_config(config_t* cfg, const char* name, string_t* str, config_entry_type_t type) {
+
+    add_config_entry(cfg, create_config_entry(name, str, type));
+}
+
+/*
+ * Same as add_config(), for an entry that the caller has already made, such
+ * as one with an array or a conversion in it. The entry belongs to the
+ * configuration after this.
+ */
+void add_config_entry(config_t* cfg, config_entry_t* ent) {
+
+    config_load_stats_t* stats = get_load_stats();
+
+    pthread_mutex_lock(&cfg->lock);
+    int replaced = insert_config_entry(cfg, ent->name, ent);
+    if(stats != NULL) {
+        stats->keys++;
+        stats->overrides += replaced;
+    }
+    mark_config_changed(cfg);
+    reclaim_config(cfg);
+    pthread_mutex_unlock(&cfg->lock);
+}
+
+static void append_config_layer(config_t* cfg, config_layer_t* layer, int upper) {
+
+    config_layer_t** ptr = (upper)? &cfg->upper: &cfg->lower;
+    while(*ptr != NULL)
+        ptr = &(*ptr)->next;
+    *ptr = layer;
+}
+
+/*
+ * Add a layer to the configuration. Upper layers are searched before the
+ * main file, in the order that they were added, and lower layers after it.
+ * The file is not read until a lookup needs it.
+ */
+void add_config_layer(config_t* cfg, const char* fname, int upper) {
+
+    config_layer_t* layer = _ALLOC_DS(config_layer_t);
+    layer->fname = _DUP_STR(fname);
+    layer->loaded = 0;
+    layer->vars = NULL;
+    layer->next = NULL;
+
+    append_config_layer(cfg, layer, upper);
+}
+
+/*
+ * Add a layer that does not come from a file. The table holds entries that
+ * are already made and it belongs to the configuration after this.
+ */
+void add_config_table(config_t* cfg, hash_table_t* vars, int upper) {
+
+    config_layer_t* layer = _ALLOC_DS(config_layer_t);
+    layer->fname = NULL;
+    layer->loaded = 1;
+    layer->vars = vars;
+    layer->next = NULL;
+
+    append_config_layer(cfg, layer, upper);
+}
+
+/*
+ * Search the layers in order and return the first entry that is found. A
+ * layer is parsed the first time it is searched. A layer that has errors is
+ * skipped with a warning.
+ */
+static config_entry_t* find_layer_entry(config_t* cfg, config_layer_t* layer, const char* name) {
+
+    for(; layer != NULL; layer = layer->next) {
+        if(!__atomic_load_n(&layer->loaded, __ATOMIC_ACQUIRE)) {
+            pthread_mutex_lock(&cfg->lock);
+            if(!layer->loaded) {
+                // this is in the middle of a lookup, so errors are not fatal
+                hash_table_t* vars = create_hash_table();
+                config_errors_t* errs = create_error_list();
+                config_errors_t* prev = set_error_list(errs);
+                int utf8 = set_utf8_check(cfg->utf8);
+                parse_config_file(layer->fname, vars, NULL);
+                set_utf8_check(utf8);
+                set_error_list(prev);
+
+                if(errs->len > 0) {
+                    print_error_list(errs, "WARNING");
+                    fprintf(stderr, "WARNING: Skipping configuration layer: %s\n", layer->fname);
+                    destroy_config_table(vars);
+                    vars = create_hash_table();
+                }
+                destroy_error_list(errs);
+
+                layer->vars = vars;
+                __atomic_store_n(&layer->loaded, 1, __ATOMIC_RELEASE);
+            }
+            pthread_mutex_unlock(&cfg->lock);
+        }
+
+        config_entry_t* ent = find_table_entry(layer->vars, name);
+        if(ent != NULL)
+            return ent;
+    }
+
+    return NULL;
+}
 
-    init_cmdline(cfg, name, pre, vers);
+/*
+ * Parse a section that was not parsed yet and put its values in the table.
+ * The values are added in the same way as update_configuration(), so
+ * readers are not blocked and the environment and command line still
+ * override them. They go at the end of the order of the table. Must be
+ * called with the lock held.
+ */
+static void parse_pending_section(config_t* cfg, config_section_t* sec) {
 
-    return cfg;
+    hash_table_t* tab = create_hash_table();
+    parse_config_section(cfg->fname, cfg->text, sec, tab);
+
+    hash_table_t* vars = cfg->vars;
+    size_t added = 0;
+    for(int k = 0; k < sec->keys->len; k++)
+        if(find_table_entry(vars, raw_string(sec->keys->list[k])) == NULL)
+            added++;
+
+    if(!table_has_room(vars, added))
+        vars = copy_hash_table(vars, added);
+
+    apply_file_keys(cfg, vars, tab, sec->keys, NULL);
+    destroy_hash_table(tab);
+
+    if(vars != cfg->vars) {
+        retire_config(cfg, cfg->vars, 1, NULL, NULL);
+        __atomic_store_n(&cfg->vars, vars, __ATOMIC_SEQ_CST);
+    }
+
+    mark_config_changed(cfg);
+    cfg->unordered = 1;
+
+    // other readers skip the lock once the entry is gone, so it is not
+    // removed until the values are in the table
+    replace_table_entry(cfg->pending, sec->name, NULL, NULL);
+    if(--cfg->npending == 0) {
+        retire_config(cfg, cfg->pending, 1, NULL, NULL);
+        __atomic_store_n(&cfg->pending, NULL, __ATOMIC_SEQ_CST);
+        _FREE(cfg->text);
+    }
+}
+
+/*
+ * If the top level section that the name would be in has not been parsed
+ * yet then parse it and put its values in the table.
+ */
+static config_entry_t* find_pending_entry(config_t* cfg, const char* name) {
+
+    hash_table_t* pending = __atomic_load_n(&cfg->pending, __ATOMIC_SEQ_CST);
+    if(pending == NULL)
+        return NULL;
+
+    size_t len = strcspn(name, ".");
+    char* sname = _ALLOC(len + 1);
+    memcpy(sname, name, len);
+
+    if(find_table_entry(pending, sname) != NULL) {
+        pthread_mutex_lock(&cfg->lock);
+
+        config_section_t* sec = NULL;
+        if(cfg->pending != NULL)
+            sec = find_table_entry(cfg->pending, sname);
+        if(sec != NULL)
+            parse_pending_section(cfg, sec);
+
+        pthread_mutex_unlock(&cfg->lock);
+    }
+
+    _FREE(sname);
+    return find_table_entry(__atomic_load_n(&cfg->vars, __ATOMIC_SEQ_CST), name);
 }
 
-void load_configuration(config_t* cfg, int argc, char** argv, char** envp) {
+/*
+ * Parse the sections of a lazy load that are not parsed yet, and then put
+ * the table back in the order of the file, because the sections went into
+ * it in the order that they were looked up. The values that did not come
+ * from the file go after them in the order that they were added. The
+ * entries are not copied, only the index. Must be called with the lock
+ * held.
+ */
+static void order_lazy_config(config_t* cfg) {
+
+    for(int i = 0; cfg->pending != NULL && i < cfg->sections->len; i++) {
+        config_section_t* sec = &cfg->sections->list[i];
+        if(find_table_entry(cfg->pending, sec->name) == sec)
+            parse_pending_section(cfg, sec);
+    }
 
-    cfg->pname = _DUP_STR(argv[0]);
+    if(!cfg->unordered)
+        return;
 
-    load_config_file(cfg);
+    hash_table_t* vars = cfg->vars;
+    hash_table_t* fresh = create_hash_table();
+    const char* key;
+    config_entry_t* ent;
 
-    // load the environment into the table
-    for(int i = 0; envp[i] != NULL; i++) {
-        char* name = envp[i];
-        char* val = strchr(name, '=');
-        if(val != NULL) {
-            *val = '\0';
-            val++;
-            add_table_entry(cfg->vars, name, create_string(val));
+    for(int i = 0; i < cfg->sections->len; i++) {
+        string_list_t* keys = cfg->sections->list[i].keys;
+        for(int k = 0; keys != NULL && k < keys->len; k++) {
+            key = raw_string(keys->list[k]);
+            if(NULL != (ent = find_table_entry(vars, key)) && find_table_entry(fresh, key) == NULL)
+                add_table_entry(fresh, key, ent);
         }
     }
 
-    parse_cmdline(cfg, argc, argv);
+    size_t mark = 0;
+    while(NULL != (ent = iter_table_entry(vars, &mark, &key)))
+        if(find_table_entry(fresh, key) == NULL)
+            add_table_entry(fresh, key, ent);
+
+    retire_config(cfg, vars, 1, NULL, NULL);
+    __atomic_store_n(&cfg->vars, fresh, __ATOMIC_SEQ_CST);
+    cfg->unordered = 0;
+}
+
+/*
+ * Put every value in the compiled cache into a table, in the order of the
+ * file, and make it the live one. The values are still read in place from
+ * the mapping, so nothing is parsed or written, and the cache is kept as
+ * the image until a reload replaces the table. The values that did not come
+ * from the file are carried over and still override it. The table is put
+ * in first, the same as a reload, see find_config_entry(). Must be called
+ * with the lock held.
+ */
+static void fill_cached_config(config_t* cfg) {
+
+    hash_table_t* vars = cfg->vars;
+    hash_table_t* fresh = create_hash_table();
+    const char* key;
+    config_entry_t* ent;
+    config_entry_t* file;
+
+    load_cache_table(cfg->cache, fresh);
+
+    // an override takes the place of the value from the file, the same as
+    // after a reload
+    size_t mark = 0;
+    while(NULL != (ent = iter_table_entry(vars, &mark, &key))) {
+        if(replace_table_entry(fresh, key, ent, (void**)&file))
+            destroy_config_entry(file);
+        else
+            add_table_entry(fresh, key, ent);
+    }
+
+    retire_config(cfg, vars, 1, NULL, NULL);
+    __atomic_store_n(&cfg->vars, fresh, __ATOMIC_SEQ_CST);
+    cfg->image = cfg->cache;
+    __atomic_store_n(&cfg->cache, NULL, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Put every value from the file into the table for an iteration or a
+ * snapshot. Must be called with the lock held.
+ */
+static void complete_config(config_t* cfg) {
+
+    if(cfg->cache != NULL)
+        fill_cached_config(cfg);
+    else if(cfg->lazy)
+        order_lazy_config(cfg);
+}
+
+/*
+ * Make the index of the environment variables that have the prefix. The
+ * values are not copied out of the environment.
+ */
+static hash_table_t* create_env_index(config_t* cfg) {
+
+    TRACE_BEGIN("env");
+    uint64_t start = get_trace_time();
+    hash_table_t* env = create_hash_table();
+    size_t plen = strlen(cfg->env_prefix);
+
+    for(int i = 0; cfg->envp != NULL && cfg->envp[i] != NULL; i++) {
+        const char* var = cfg->envp[i];
+        const char* val = strchr(var, '=');
+        if(val == NULL || strncmp(var, cfg->env_prefix, plen) || val == &var[plen])
+            continue;
+
+        size_t len = val - &var[plen];
+        char* name = _ALLOC(len + 1);
+        for(size_t k = 0; k < len; k++)
+            name[k] = (var[plen+k] == '_')? '.': tolower((unsigned char)var[plen+k]);
+
+        add_table_entry(env, name, (void*)&val[1]);
+        _FREE(name);
+    }
+
+    cfg->stats.env_ns = get_trace_time() - start;
+    TRACE_END("env", env->len);
+    return env;
+}
+
+/*
+ * Look for the name in the environment. The value is put into the table as
+ * a CFG_ENV entry the first time it is found, so after that it is found
+ * there. The entry that was found in the table, if any, is marked when the
+ * environment does not have the name so it is not searched again.
+ */
+static config_entry_t* find_env_entry(config_t* cfg, const char* name, config_entry_t* ent) {
+
+    const char* val;
+
+    if(cfg->env_prefix != NULL) {
+        hash_table_t* env = __atomic_load_n(&cfg->env, __ATOMIC_ACQUIRE);
+        if(env == NULL) {
+            pthread_mutex_lock(&cfg->lock);
+            if(cfg->env == NULL)
+                __atomic_store_n(&cfg->env, create_env_index(cfg), __ATOMIC_RELEASE);
+            env = cfg->env;
+            pthread_mutex_unlock(&cfg->lock);
+        }
+        val = find_table_entry(env, name);
+    }
+    else
+        val = getenv(name);
+
+    if(val == NULL) {
+        if(ent != NULL)
+            __atomic_store_n(&ent->env_checked, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&cfg->lock);
+
+    // another reader may have put it there already
+    config_entry_t* found = find_table_entry(cfg->vars, name);
+    if(found == NULL || (found->type & CFG_FILE)) {
+        found = create_config_entry(name, create_string(val), CFG_ENV);
+        insert_config_entry(cfg, name, found);
+    }
+
+    pthread_mutex_unlock(&cfg->lock);
+    return found;
+}
+
+/*
+ * Look for the name in the compiled cache. The entry that is returned
+ * belongs to the cache and its value is read in place from the mapping, so
+ * nothing is put into the table. The cache is retired with the table when
+ * the file is reloaded.
+ */
+static config_entry_t* find_cached_entry(config_t* cfg, const char* name) {
+
+    config_cache_t* cache = __atomic_load_n(&cfg->cache, __ATOMIC_SEQ_CST);
+
+    return (cache != NULL)? find_cache_entry(cache, name): NULL;
+}
+
+/*
+ * Find the entry that has the highest precedence. The command line is in
+ * the main table with the main file. The environment and then the upper
+ * layers come between them, so they are only searched when the main table
+ * has nothing or has a value from the file. Values in the compiled cache
+ * are read from it in place and count as values from the file. Values that
+ * come from the environment or a section that was not parsed yet are put
+ * into the table the first time they are read. The lower layers are only
+ * searched when nothing else has the name. The main table is normally the
+ * live one, but it can be the one in a snapshot.
+ */
+static config_entry_t* search_config(config_t* cfg, hash_table_t* vars, const char* name) {
+
+    config_entry_t* ent = find_table_entry(vars, name);
+    if(ent == NULL)
+        ent = find_cached_entry(cfg, name);
+
+    if(ent == NULL || ((ent->type & CFG_FILE) &&
+                !__atomic_load_n(&ent->env_checked, __ATOMIC_RELAXED))) {
+        config_entry_t* env = find_env_entry(cfg, name, ent);
+        if(env != NULL)
+            return env;
+    }
+
+    if(cfg->upper != NULL && (ent == NULL || (ent->type & CFG_FILE))) {
+        config_entry_t* over = find_layer_entry(cfg, cfg->upper, name);
+        if(over != NULL)
+            return over;
+    }
+
+    if(ent == NULL)
+        ent = find_pending_entry(cfg, name);
+
+    if(ent == NULL && cfg->lower != NULL)
+        ent = find_layer_entry(cfg, cfg->lower, name);
+
+    return ent;
+}
+
+#define MAX_EXPAND 16
+
+// The entries that this thread is in the middle of expanding, which is how
+// a value that refers back to itself is found.
+static _Thread_local config_entry_t* expanding[MAX_EXPAND];
+static _Thread_local int nexpanding;
+
+// Set when an expansion on this thread ran into a circular reference or
+// went too deep, so that the values made from it are not defined.
+#define EXPAND_CIRCULAR 0x01
+#define EXPAND_TOO_DEEP 0x02
+static _Thread_local int circular;
+
+static config_entry_t* expand_entry(config_t* cfg, hash_table_t* vars,
+                unsigned long generation, config_entry_t* ent);
+
+/*
+ * Make the value of the entry with each ${name} replaced by the value of
+ * name and each ${env:NAME} by the environment variable. A reference that
+ * cannot be expanded is replaced by nothing, with a warning.
+ */
+static string_t* expand_value(config_t* cfg, hash_table_t* vars,
+                unsigned long generation, config_entry_t* ent) {
+
+    const char* text = raw_string(ent->raw);
+    string_t* str = create_string(NULL);
+    const char* end;
+
+    while(*text != '\0') {
+        if(text[0] != '$' || text[1] != '{' || (end = strchr(&text[2], '}')) == NULL) {
+            append_string_char(str, *text++);
+            continue;
+        }
+
+        size_t len = end - &text[2];
+        char* name = _ALLOC(len + 1);
+        memcpy(name, &text[2], len);
+        text = &end[1];
+
+        if(!strncmp(name, "env:", 4)) {
+            const char* val = getenv(&name[4]);
+            if(val != NULL)
+                append_string_str(str, val);
+            else
+                fprintf(stderr, "WARNING: Config value %s refers to ${%s}, which is not defined\n",
+                            ent->name, name);
+        }
+        else {
+            config_entry_t* ref = search_config(cfg, vars, name);
+            config_entry_t* val = expand_entry(cfg, vars, generation, ref);
+            if(val != NULL)
+                append_string_string(str, val->raw);
+            else if(ref == NULL)
+                fprintf(stderr, "WARNING: Config value %s refers to ${%s}, which is not defined\n",
+                            ent->name, name);
+            else
+                fprintf(stderr, "WARNING: Config value %s refers to ${%s}, which is circular or too deep\n",
+                            ent->name, name);
+        }
+
+        _FREE(name);
+    }
+
+    return str;
+}
+
+/*
+ * Return the entry that holds the value that a reader should see. Values
+ * from a file can refer to other values, and those are expanded the first
+ * time the value is read. The result is kept in the entry and used until
+ * the generation of the values changes. A snapshot has the generation that
+ * it was taken at. Returns NULL if the value is part of a circular
+ * reference or refers to one, or if the references are too deep. That is
+ * kept the same way, so the warnings are only printed once. A value that is
+ * too deep when it is reached from another one may not be when it is read
+ * by itself, so that is only kept for the value that was read.
+ */
+static config_entry_t* expand_entry(config_t* cfg, hash_table_t* vars,
+                unsigned long generation, config_entry_t* ent) {
+
+    // the elements of an array are not expanded
+    if(ent == NULL || !(ent->type & CFG_FILE) || ent->values != NULL)
+        return ent;
+
+    int interp = __atomic_load_n(&ent->interp, __ATOMIC_RELAXED);
+    if(interp == 0) {
+        interp = (strstr(raw_string(ent->raw), "${") != NULL)? 2: 1;
+        __atomic_store_n(&ent->interp, interp, __ATOMIC_RELAXED);
+    }
+
+    if(interp == 1)
+        return ent;
+
+    // a value that is not defined is kept without a raw value
+    config_entry_t* memo = __atomic_load_n(&ent->expanded, __ATOMIC_ACQUIRE);
+    if(memo != NULL && memo->generation == generation) {
+        if(memo->raw == NULL)
+            circular |= EXPAND_CIRCULAR;
+        return (memo->raw != NULL)? memo: NULL;
+    }
+
+    for(int i = 0; i < nexpanding; i++) {
+        if(expanding[i] == ent) {
+            circular |= EXPAND_CIRCULAR;
+            return NULL;
+        }
+    }
+    if(nexpanding >= MAX_EXPAND) {
+        circular |= EXPAND_TOO_DEEP;
+        return NULL;
+    }
+
+    int outer = (nexpanding > 0)? circular: 0;
+    circular = 0;
+
+    expanding[nexpanding++] = ent;
+    string_t* str = expand_value(cfg, vars, generation, ent);
+    nexpanding--;
+
+    // the flag is left set so that the values that refer to this one are
+    // not defined either
+    int failed = circular;
+    circular = failed | outer;
+    if(failed) {
+        destroy_string(str);
+        str = NULL;
+        if((failed & EXPAND_TOO_DEEP) && nexpanding > 0)
+            return NULL;
+    }
+
+    config_entry_t* fresh = create_config_entry(ent->name, str, ent->type);
+    fresh->generation = generation;
+
+    // a newer one is not replaced by an older one that a snapshot needs
+    while(memo == NULL || memo->generation < generation) {
+        if(__atomic_compare_exchange_n(&ent->expanded, &memo, fresh, 0,
+                    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+            if(memo != NULL)
+                retire_config(cfg, NULL, 0, NULL, memo);
+            return (str != NULL)? fresh: NULL;
+        }
+    }
+
+    retire_config(cfg, NULL, 0, NULL, fresh);
+    return (str != NULL)? fresh: NULL;
+}
+
+/*
+ * Find the value that a reader of the live configuration should see. The
+ * generation is read before the table, so an expansion is never marked newer
+ * than the values that it was made from.
+ *
+ * A reload puts in the table that has the whole file before it lets go of
+ * the cache and the sections that were not parsed. A reader that read the
+ * table before that and looks in them after can miss a name that is in the
+ * file, so if they were in use, a miss is looked for again in the table
+ * that replaced it.
+ */
+static config_entry_t* find_config_entry(config_t* cfg, const char* name) {
+
+    int partial = (__atomic_load_n(&cfg->cache, __ATOMIC_SEQ_CST) != NULL ||
+                __atomic_load_n(&cfg->pending, __ATOMIC_SEQ_CST) != NULL);
+    unsigned long generation = __atomic_load_n(&cfg->generation, __ATOMIC_SEQ_CST);
+    hash_table_t* vars = __atomic_load_n(&cfg->vars, __ATOMIC_SEQ_CST);
+    config_entry_t* ent = search_config(cfg, vars, name);
+
+    if(ent == NULL && partial && vars != __atomic_load_n(&cfg->vars, __ATOMIC_SEQ_CST)) {
+        generation = __atomic_load_n(&cfg->generation, __ATOMIC_SEQ_CST);
+        vars = __atomic_load_n(&cfg->vars, __ATOMIC_SEQ_CST);
+        ent = search_config(cfg, vars, name);
+    }
+
+    return expand_entry(cfg, vars, generation, ent);
+}
+
+/*
+ * Convert the raw value of the entry and keep the result in the entry, so
+ * it is only converted once. More than one reader can get here at the same
+ * time, but they all store the same result. A value that is not a valid
+ * number is converted to 0 with a warning.
+ */
+static void convert_entry(config_entry_t* ent, config_conv_t conv) {
+
+    const char* str = (ent->raw != NULL)? raw_string(ent->raw): "";
+    const char* kind;
+    char* end;
+    int ok;
+
+    errno = 0;
+    switch(conv) {
+        case CFG_CONV_INTEGER: {
+                long val = strtol(str, &end, 0);
+                ok = (end != str && *end == '\0' && errno == 0);
+                __atomic_store_n(&ent->integer, (ok)? val: 0, __ATOMIC_RELAXED);
+                kind = "integer";
+            }
+            break;
+        case CFG_CONV_UNSIGNED: {
+                unsigned long val = strtoul(str, &end, 0);
+                ok = (end != str && *end == '\0' && errno == 0 && strchr(str, '-') == NULL);
+                __atomic_store_n(&ent->unsig, (ok)? val: 0, __ATOMIC_RELAXED);
+                kind = "unsigned";
+            }
+            break;
+        default: {
+                double val = strtod(str, &end);
+                ok = (end != str && *end == '\0' && errno == 0);
+                if(!ok)
+                    val = 0.0;
+                __atomic_store(&ent->real, &val, __ATOMIC_RELAXED);
+                kind = "float";
+            }
+            break;
+    }
+
+    if(!ok)
+        fprintf(stderr, "WARNING: Config value %s = \"%s\" is not a valid %s\n",
+                    ent->name, str, kind);
+
+    __atomic_fetch_or(&ent->conv, conv, __ATOMIC_RELEASE);
+}
+
+/*
+ * Find the entry for a typed getter and make sure that it has the
+ * conversion. Must be called between enter_config() and leave_config().
+ */
+static config_entry_t* find_converted_entry(const char* name, config_conv_t conv) {
+
+    config_entry_t* ent = find_config_entry(config, name);
+
+    if(ent != NULL && !(__atomic_load_n(&ent->conv, __ATOMIC_ACQUIRE) & conv))
+        convert_entry(ent, conv);
+
+    return ent;
+}
+
+/*
+ * Return the value of a config item or NULL if it is not defined.
+ */
+string_t* get_config(const char* name) {
+
+    assert(name != NULL);
+    assert(config != NULL);
+
+    enter_config(config);
+    config_entry_t* ent = find_config_entry(config, name);
+    string_t* str = (ent != NULL)? ent->raw: NULL;
+    leave_config(config);
+
+    return str;
+}
+
+/*
+ * Get the values of many names at once. The main table is searched for all
+ * of them in one batch, so that the lookups overlap. A name that the batch
+ * does not settle, because it was not found or another layer could override
+ * it, is looked up the usual way. The values, or NULL, are put in out.
+ */
+void get_config_many(config_t* cfg, const char** names, string_t** out, size_t n) {
+
+    assert(names != NULL);
+    assert(out != NULL);
+
+    void* ents[32];
+
+    enter_config(cfg);
+    unsigned long generation = __atomic_load_n(&cfg->generation, __ATOMIC_SEQ_CST);
+    hash_table_t* vars = __atomic_load_n(&cfg->vars, __ATOMIC_SEQ_CST);
+
+    for(size_t base = 0; base < n; base += 32) {
+        size_t count = (n - base < 32)? n - base: 32;
+        find_table_entries(vars, &names[base], ents, count);
+
+        for(size_t i = 0; i < count; i++) {
+            config_entry_t* ent = ents[i];
+            if(ent == NULL || ((ent->type & CFG_FILE) && (cfg->upper != NULL ||
+                        !__atomic_load_n(&ent->env_checked, __ATOMIC_RELAXED))))
+                ent = find_config_entry(cfg, names[base+i]);
+            else
+                ent = expand_entry(cfg, vars, generation, ent);
+
+            out[base+i] = (ent != NULL)? ent->raw: NULL;
+        }
+    }
+
+    leave_config(cfg);
+}
+
+/*
+ * Return the entry after the mark in the main table and move the mark past
+ * it. The values from the file come in the order of the file, followed by
+ * the ones that were added after it, such as the command line. A value
+ * that overrides one from the file takes its place. Start with
+ * the mark set to zero. Returns NULL when there are no more.
+ *
+ * If some of the file is only in the compiled cache or in sections that are
+ * not parsed yet, then starting an iteration puts all of it in the table
+ * first, the same as acquire_config_snapshot(), which does not read the
+ * file or write the cache. A lazy load is put back in
+ * the order of the file then, which starts a new order. After that nothing
+ * is allocated, and the mark stays good while values are added or changed,
+ * so an iteration can be picked up later. A reload starts a new order too.
+ * The values are raw, without the ${} references expanded. Layers and
+ * environment variables that were never looked up are not included.
+ */
+config_entry_t* iter_config(config_t* cfg, size_t* mark) {
+
+    if(*mark == 0) {
+        // the same as for a snapshot, the whole file has to be in the table
+        pthread_mutex_lock(&cfg->lock);
+        complete_config(cfg);
+        pthread_mutex_unlock(&cfg->lock);
+    }
+
+    enter_config(cfg);
+    config_entry_t* ent = iter_table_entry(__atomic_load_n(&cfg->vars, __ATOMIC_SEQ_CST),
+                mark, NULL);
+    leave_config(cfg);
+
+    return ent;
+}
+
+/*
+ * Take another reference to a snapshot, unless it has already been released
+ * by everything that held it.
+ */
+static int hold_config_snapshot(config_snapshot_t* snap) {
+
+    int refs = __atomic_load_n(&snap->refs, __ATOMIC_SEQ_CST);
+
+    while(refs > 0)
+        if(__atomic_compare_exchange_n(&snap->refs, &refs, refs + 1, 0,
+                    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+            return 1;
+
+    return 0;
+}
+
+/*
+ * Return a snapshot of the values that will not change until it is
+ * released, no matter what reloads or overrides happen in the meantime.
+ * Everyone who acquires one before the values change shares the same
+ * snapshot, and taking it does not lock anything. After a change, the next
+ * one is made by copying the index of the table, but not the values.
+ *
+ * The snapshot needs every value from the file to be in the table. When
+ * the cache is in use, the first one makes a table of all of the values in
+ * it, which are still read in place. That costs an entry for each value,
+ * but the file is not read or parsed. The sections of a lazy load that are
+ * not parsed yet are parsed, and the table is put in the order of the file.
+ */
+config_snapshot_t* acquire_config_snapshot(config_t* cfg) {
+
+    assert(cfg != NULL);
+
+    enter_config(cfg);
+    config_snapshot_t* snap = __atomic_load_n(&cfg->snapshot, __ATOMIC_SEQ_CST);
+    int held = (snap != NULL && hold_config_snapshot(snap));
+    leave_config(cfg);
+
+    if(held)
+        return snap;
+
+    pthread_mutex_lock(&cfg->lock);
+    complete_config(cfg);
+
+    snap = cfg->snapshot;
+    if(snap == NULL) {
+        snap = _ALLOC_DS(config_snapshot_t);
+        snap->cfg = cfg;
+        snap->vars = copy_hash_table(cfg->vars, 0);
+        snap->epoch = __atomic_load_n(&cfg->epoch, __ATOMIC_SEQ_CST);
+        snap->generation = __atomic_load_n(&cfg->generation, __ATOMIC_SEQ_CST);
+        snap->refs = 1;     // the one that cfg->snapshot has
+        snap->next = cfg->snapshots;
+        cfg->snapshots = snap;
+        __atomic_store_n(&cfg->snapshot, snap, __ATOMIC_SEQ_CST);
+    }
+    __atomic_add_fetch(&snap->refs, 1, __ATOMIC_SEQ_CST);
+
+    pthread_mutex_unlock(&cfg->lock);
+    return snap;
+}
+
+/*
+ * Let go of a snapshot. Nothing that was taken from it can be used after
+ * this. It is freed later, when nothing holds it.
+ */
+void release_config_snapshot(config_snapshot_t* snap) {
+
+    if(snap == NULL)
+        return;
+
+    // once the count is zero the snapshot can be freed by someone else
+    config_t* cfg = snap->cfg;
+
+    if(__atomic_sub_fetch(&snap->refs, 1, __ATOMIC_SEQ_CST) == 0 &&
+                !pthread_mutex_trylock(&cfg->lock)) {
+        reclaim_config(cfg);
+        pthread_mutex_unlock(&cfg->lock);
+    }
+}
+
+/*
+ * Return the value of a config item as it was when the snapshot was taken,
+ * or NULL if it was not defined. The value is good until the snapshot is
+ * released.
+ */
+string_t* get_snapshot_config(config_snapshot_t* snap, const char* name) {
+
+    assert(snap != NULL);
+    assert(name != NULL);
+
+    enter_config(snap->cfg);
+    config_entry_t* ent = expand_entry(snap->cfg, snap->vars, snap->generation,
+                search_config(snap->cfg, snap->vars, name));
+    string_t* str = (ent != NULL)? ent->raw: NULL;
+    leave_config(snap->cfg);
+
+    return str;
+}
+
+/*
+ * Same as iter_config(), for the values in the snapshot. The snapshot always
+ * has the whole file.
+ */
+config_entry_t* iter_snapshot_config(config_snapshot_t* snap, size_t* mark) {
+
+    assert(snap != NULL);
+
+    return iter_table_entry(snap->vars, mark, NULL);
 }
 
+/*
+ * Return a copy of the value of a config item that the caller must destroy,
+ * or NULL if it is not defined.
+ */
 string_t* get_config_string(const char* name) {
 
     assert(name != NULL);
+    assert(config != NULL);
+
+    enter_config(config);
+    config_entry_t* ent = find_config_entry(config, name);
+    string_t* str = (ent != NULL && ent->raw != NULL)? copy_string(ent->raw): NULL;
+    leave_config(config);
+
+    return str;
 }
 
+/*
+ * Return the text of a config item or NULL if it is not defined.
+ */
 const char* get_config_str(const char* name) {
 
+    string_t* str = get_config(name);
+
+    return (str != NULL)? raw_string(str): NULL;
+}
+
+/*
+ * Return the number of elements in an array. A value that is not an array
+ * is treated as an array of one, and a name that is not defined has none.
+ */
+int get_config_array_len(const char* name) {
+
+    assert(name != NULL);
+    assert(config != NULL);
+
+    enter_config(config);
+    config_entry_t* ent = find_config_entry(config, name);
+    int len = (ent == NULL)? 0: (ent->values != NULL)? ent->values->len: 1;
+    leave_config(config);
+
+    return len;
+}
+
+/*
+ * Return an element of an array, or NULL if the index is out of range. The
+ * elements are kept in a table when the file is read, so this does not split
+ * the value up again.
+ */
+string_t* get_config_array_item(const char* name, int idx) {
+
     assert(name != NULL);
+    assert(config != NULL);
+
+    string_t* str = NULL;
+
+    enter_config(config);
+    config_entry_t* ent = find_config_entry(config, name);
+    if(ent != NULL && ent->values != NULL) {
+        if(idx >= 0 && idx < ent->values->len)
+            str = ent->values->list[idx];
+    }
+    else if(ent != NULL && idx == 0)
+        str = ent->raw;
+    leave_config(config);
+
+    return str;
 }
 
+/*
+ * Return the value of a config item as a number, or 0 if it is not defined.
+ * The conversion is only done the first time.
+ */
 unsigned long get_config_unsigned(const char* name) {
 
     assert(name != NULL);
+    assert(config != NULL);
+
+    enter_config(config);
+    config_entry_t* ent = find_converted_entry(name, CFG_CONV_UNSIGNED);
+    unsigned long val = (ent != NULL)? __atomic_load_n(&ent->unsig, __ATOMIC_RELAXED): 0;
+    leave_config(config);
+
+    return val;
 }
 
 long get_config_integer(const char* name) {
 
     assert(name != NULL);
+    assert(config != NULL);
+
+    enter_config(config);
+    config_entry_t* ent = find_converted_entry(name, CFG_CONV_INTEGER);
+    long val = (ent != NULL)? __atomic_load_n(&ent->integer, __ATOMIC_RELAXED): 0;
+    leave_config(config);
+
+    return val;
 }
 
 double get_config_float(const char* name) {
 
     assert(name != NULL);
+    assert(config != NULL);
+
+    double val = 0.0;
+
+    enter_config(config);
+    config_entry_t* ent = find_converted_entry(name, CFG_CONV_FLOAT);
+    if(ent != NULL)
+        __atomic_load(&ent->real, &val, __ATOMIC_RELAXED);
+    leave_config(config);
+
+    return val;
 }
@@ -4,6 +4,9 @@
 #ifndef _CONFIG_H_
 #define _CONFIG_H_
 
+#include <pthread.h>
+#include <stdint.h>
+
 #include "hash.h"
 #include "str.h"
 
@@ -14,29 +17,190 @@ typedef enum {
     CFG_LIST = 0x80,
 } config_entry_type_t;
 
+// Which native conversions of the raw value have been cached.
+typedef enum {
+    CFG_CONV_INTEGER = 0x01,
+    CFG_CONV_UNSIGNED = 0x02,
+    CFG_CONV_FLOAT = 0x04,
+} config_conv_t;
+
 typedef struct _config_entry_t_ {
     const char* name;
     config_entry_type_t type;
     string_t* raw;
-    string_list_t* values;
+    string_list_t* values;     // the elements, if the value is an array
+
+    int env_checked;    // the environment does not override this value
+
+    // the value with ${} references expanded, see expand_entry()
+    int interp;         // 0 not known yet, 1 has none, 2 has some
+    struct _config_entry_t_* expanded;
+    unsigned long generation;   // of the values that it was expanded from
+
+    // the raw value converted the first time each type was asked for
+    int conv;
+    long integer;
+    unsigned long unsig;
+    double real;
 } config_entry_t;
 
+struct _config_t_;
+typedef void (*config_reload_cb_t)(struct _config_t_*);
+
+// A table or an entry that was replaced by a reload, but may still be in
+// use by a reader. It is freed when there are no readers left.
+typedef struct _config_retired_t_ {
+    hash_table_t* vars;
+    int shared;         // the entries in vars are still in use by the new table
+    struct _config_cache_t_* cache;
+    struct _config_entry_t_* entry;
+    unsigned long epoch;    // when it was retired
+    struct _config_retired_t_* next;
+} config_retired_t;
+
+// A view of the values that does not change. See acquire_config_snapshot().
+typedef struct _config_snapshot_t_ {
+    struct _config_t_* cfg;
+    hash_table_t* vars;     // shares the entries with the table it copied
+    unsigned long epoch;    // when it was taken
+    unsigned long generation;
+    int refs;
+    struct _config_snapshot_t_* next;
+} config_snapshot_t;
+
+typedef enum {
+    CFG_ADDED,
+    CFG_UPDATED,
+    CFG_REMOVED,
+} config_change_type_t;
+
+typedef struct _config_change_t_ {
+    const char* name;
+    config_change_type_t type;
+} config_change_t;
+
+// What update_configuration() did to the table.
+typedef struct _config_changes_t_ {
+    config_change_t* list;
+    int len;
+    int cap;
+} config_changes_t;
+
+// A configuration file other than the main one. Each one has its own table,
+// which is not read until a lookup gets to it.
+typedef struct _config_layer_t_ {
+    const char* fname;
+    int loaded;
+    hash_table_t* vars;
+    struct _config_layer_t_* next;
+} config_layer_t;
+
+// What load_configuration() did and how long each part of it took. The
+// times are in nanoseconds. The environment is indexed when the first name
+// is looked up, so env_ns is normally filled in after the load.
+typedef struct _config_load_stats_t_ {
+    uint64_t total_ns;
+    uint64_t find_ns;       // finding the file and the layers
+    uint64_t cache_ns;      // opening or saving the compiled cache
+    uint64_t scan_ns;       // reading the file and dividing it into sections
+    uint64_t parse_ns;      // tokenizing and parsing
+    uint64_t env_ns;
+    uint64_t cmdline_ns;
+    uint64_t bytes_read;
+    uint64_t tokens;
+    uint64_t keys;          // values put into a table
+    uint64_t overrides;     // of those, the ones that replaced another value
+    uint64_t allocs;
+    int cache_hit;
+} config_load_stats_t;
+
 typedef struct _config_t_ {
     const char* pname;
     const char* name;
     const char* pream;
     const char* version;
+    const char* fname;
     hash_table_t* vars;
+    struct _config_cache_t_* cache;
+    struct _config_cache_t_* image;     // the cache that the table's values are in
+    struct _section_list_t_* sections;
+    config_layer_t* upper;      // layers that override the main file
+    config_layer_t* lower;      // layers that the main file overrides
     struct _cmdline_t_* cmdline;
+    const struct _config_schema_t_* schema;
+    void* schema_dest;          // the struct that the schema describes
+
+    int utf8;                   // check that the files are valid UTF-8
+
+    // support for parsing sections the first time they are used
+    int lazy;
+    char* text;                 // the text of the file
+    hash_table_t* pending;      // sections that are not parsed yet, by name
+    int npending;
+    int unordered;              // sections were parsed out of the file order
+
+    // support for reading the environment when a name is looked up
+    const char* env_prefix;
+    char** envp;
+    hash_table_t* env;          // variables with the prefix, by config name
+
+    // the shared memory object to get the compiled values from
+    const char* shared;
+
+    // support for reloading the file while running
+    int readers;
+    config_retired_t* retired;
+    config_retired_t* pinned;   // retired, but still in a snapshot
+    unsigned long epoch;
+    unsigned long generation;   // changes whenever a value changes
+    config_snapshot_t* snapshot;    // the current one, if it is still good
+    config_snapshot_t* snapshots;   // all of them that have not been freed
+    pthread_mutex_t lock;
+    pthread_mutex_t notify;     // held while the reload callbacks run
+    config_changes_t* changes;  // valid during the reload callbacks
+    config_reload_cb_t* reload_cbs;
+    int reload_len;
+    int reload_cap;
+    struct _config_watch_t_* watch;
+    config_load_stats_t stats;
 } config_t;
 
 config_t* init_configuration(const char* name,
                 const char* preamble,
                 const char* vers);
 
-void load_configuration(config_t* cfg, int argc, char** argv, char** envp);
+const config_load_stats_t* load_configuration(config_t* cfg, int argc, char** argv, char** envp);
+void set_config_lazy(config_t* cfg, int lazy);
+void set_config_utf8(config_t* cfg, int on);
+void set_config_env_prefix(config_t* cfg, const char* prefix);
+void set_config_shared(config_t* cfg, const char* name);
+int publish_configuration(config_t* cfg, const char* name);
+void unpublish_configuration(const char* name);
+
+void reload_configuration(config_t* cfg);
+config_changes_t* update_configuration(config_t* cfg);
+void destroy_config_changes(config_changes_t* changes);
+void add_config_reload(config_t* cfg, config_reload_cb_t cb);
 
+config_entry_t* create_config_entry(const char* name, string_t* str, config_entry_type_t type);
+void destroy_config_entry(config_entry_t* ent);
 void add_config(config_t* cfg, const char* name, string_t* str, config_entry_type_t type);
+void add_config_entry(config_t* cfg, config_entry_t* ent);
+void add_config_layer(config_t* cfg, const char* fname, int upper);
+void add_config_table(config_t* cfg, hash_table_t* vars, int upper);
 string_t* get_config(const char* name);
+config_snapshot_t* acquire_config_snapshot(config_t* cfg);
+void release_config_snapshot(config_snapshot_t* snap);
+string_t* get_snapshot_config(config_snapshot_t* snap, const char* name);
+config_entry_t* iter_snapshot_config(config_snapshot_t* snap, size_t* mark);
+void get_config_many(config_t* cfg, const char** names, string_t** out, size_t n);
+config_entry_t* iter_config(config_t* cfg, size_t* mark);
+string_t* get_config_string(const char* name);
+const char* get_config_str(const char* name);
+int get_config_array_len(const char* name);
+string_t* get_config_array_item(const char* name, int idx);
+unsigned long get_config_unsigned(const char* name);
+long get_config_integer(const char* name);
+double get_config_float(const char* name);
 
 #endif /* _CONFIG_H_ */
@@ -8,8 +8,10 @@
 
 #include "memory.h"
 #include "hash.h"
+#include "trace.h"
 
 #define MAX_HASH 5
+#define BATCH_SIZE 16
 
 /*
  * Don't barf if one of the strings is NULL and if they both are NULL, then
@@ -74,21 +76,27 @@ static void destroy_entry(hash_entry_t* entry) {
 /*
  * Find a table entry. Return NULL if the key is not found.
  */
-static inline hash_entry_t* find_entry(hash_table_t* tab, const char* key) {
-
-    size_t slot = create_hash(key) & (tab->cap - 1);
+static inline hash_entry_t* find_in_chain(hash_entry_t* crnt, const char* key) {
 
-    hash_entry_t* crnt = tab->table[slot];
+    // entries can be appended while the table is being read, see
+    // replace_table_entry()
     while(crnt != NULL) {
         if(!comp_str(key, crnt->key))
             return crnt;
         else
-            crnt = crnt->next;
+            crnt = __atomic_load_n(&crnt->next, __ATOMIC_ACQUIRE);
     }
 
     return NULL;
 }
 
+static inline hash_entry_t* find_entry(hash_table_t* tab, const char* key) {
+
+    size_t slot = create_hash(key) & (tab->cap - 1);
+
+    return find_in_chain(__atomic_load_n(&tab->table[slot], __ATOMIC_ACQUIRE), key);
+}
+
 /*
  * Remove an entry from the table. Silently fail if the entry is not found.
  */
@@ -112,30 +120,22 @@ static inline void add_entry(hash_table_t* tab, hash_entry_t* entry) {
     hash_entry_t* crnt;
 
     if(tab->table[slot] != NULL) {
-        if(!comp_str(entry->key, tab->table[slot]->key)) {
-            crnt = tab->table[slot];
-            _FREE(tab->table[slot]->key);
-            tab->table[slot]->key = NULL;
-            while(crnt->next != NULL)
-                crnt = crnt->next;
-            crnt->next = entry;
-            tab->len--;
-        }
-        else {
-            crnt = tab->table[slot];
-            while(crnt->next != NULL) {
-                if(!comp_str(entry->key, crnt->key)) {
-                    _FREE(tab->table[slot]->key);
-                    tab->table[slot]->key = NULL;
-                    tab->len--;
-                }
-                crnt = crnt->next;
+        crnt = tab->table[slot];
+        while(1) {
+            if(!comp_str(entry->key, crnt->key)) {
+                // the old entry is removed by deleting the key
+                _FREE(crnt->key);
+                crnt->key = NULL;
+                tab->len--;
             }
-            crnt->next = entry;
+            if(crnt->next == NULL)
+                break;
+            crnt = crnt->next;
         }
+        __atomic_store_n(&crnt->next, entry, __ATOMIC_RELEASE);
     }
     else {
-        tab->table[slot] = entry;
+        __atomic_store_n(&tab->table[slot], entry, __ATOMIC_RELEASE);
     }
 }
 
@@ -152,6 +152,7 @@ static void rehash(hash_table_t* tab) {
         size_t old_cap = tab->cap;
         hash_entry_t** old_table = tab->table;
 
+        TRACE_BEGIN("rehash");
         tab->cap <<= 1;
         tab->table = _ALLOC_ARRAY(hash_entry_t*, tab->cap);
 
@@ -164,12 +165,17 @@ static void rehash(hash_table_t* tab) {
                     crnt->next = NULL;
                     if(crnt->key != NULL)
                         add_entry(tab, crnt);
-                    else
+                    else {
+                        tab->order[crnt->pos] = NULL;
                         destroy_entry(crnt);
+                    }
                     crnt = next;
                 }
             }
         }
+
+        _FREE(old_table);
+        TRACE_END("rehash", tab->cap);
     }
 }
 
@@ -195,6 +201,8 @@ hash_table_t* create_hash_table(void) {
     tab->len = 0;
     tab->cap = 1 << 3;
     tab->table = _ALLOC_ARRAY(hash_entry_t*, tab->cap);
+    tab->ordcap = tab->cap;
+    tab->order = _ALLOC_ARRAY(hash_entry_t*, tab->ordcap);
 
     return tab;
 }
@@ -216,18 +224,39 @@ void destroy_hash_table(hash_table_t* tab) {
             }
         }
     }
+
+    _FREE(tab->table);
+    _FREE(tab->order);
+    _FREE(tab);
 }
 
 /*
- * Add an entry to the hash table. Cannot add a duplicate entry. Note that
- * going forward, a duplicate entry should probably replace the existing
- * one.
+ * Put the entry at the end of the order. The count is stored last, so a
+ * reader that is iterating never sees a slot that is not filled in.
+ */
+static inline void append_order(hash_table_t* tab, hash_entry_t* entry) {
+
+    if(tab->norder+1 > tab->ordcap) {
+        tab->ordcap <<= 1;
+        tab->order = _REALLOC_ARRAY(tab->order, hash_entry_t*, tab->ordcap);
+    }
+
+    entry->pos = tab->norder;
+    tab->order[tab->norder] = entry;
+    __atomic_store_n(&tab->norder, tab->norder + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Add an entry to the hash table. A duplicate entry replaces the existing
+ * one, and the new one goes at the end of the order.
  */
 void add_table_entry(hash_table_t* tab, const char* key, void* val) {
 
     rehash(tab);
 
-    add_entry(tab, create_entry(key, val));
+    hash_entry_t* entry = create_entry(key, val);
+    append_order(tab, entry);
+    add_entry(tab, entry);
     tab->len++;
 }
 
@@ -240,18 +269,183 @@ void* find_table_entry(hash_table_t* tab, const char* key) {
     hash_entry_t* entry = find_entry(tab, key);
 
     if(entry != NULL)
-        return entry->val;
+        return __atomic_load_n(&entry->val, __ATOMIC_ACQUIRE);
     else
         return NULL;
 }
 
+/*
+ * Return the value of the next entry after the mark in the order that they
+ * were added and move the mark past it. Start with the mark set to zero.
+ * Entries that were removed or have no value are skipped. If key is not
+ * NULL then the key is put in it. Return NULL when there are no more.
+ *
+ * The mark is just an index into the order, so an iteration can be stopped
+ * and picked up later, even after entries were added, replaced or removed,
+ * or the table was copied with copy_hash_table(). Nothing is allocated.
+ */
+void* iter_table_entry(hash_table_t* tab, size_t* mark, const char** key) {
+
+    size_t norder = __atomic_load_n(&tab->norder, __ATOMIC_ACQUIRE);
+
+    while(*mark < norder) {
+        hash_entry_t* entry = tab->order[*mark];
+        *mark = *mark + 1;
+        if(entry != NULL && entry->key != NULL) {
+            void* val = __atomic_load_n(&entry->val, __ATOMIC_ACQUIRE);
+            if(val != NULL) {
+                if(key != NULL)
+                    *key = entry->key;
+                return val;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Find a batch of keys and put the value of each one, or NULL, in vals. All
+ * of the keys are hashed and their slots are prefetched, then the first
+ * entry of each chain is prefetched, before any chain is searched. That way
+ * the cache misses of the lookups overlap instead of being taken one after
+ * the other.
+ */
+void find_table_entries(hash_table_t* tab, const char** keys, void** vals, size_t n) {
+
+    size_t slots[BATCH_SIZE];
+    hash_entry_t* heads[BATCH_SIZE];
+    size_t mask = tab->cap - 1;
+
+    for(size_t base = 0; base < n; base += BATCH_SIZE) {
+        size_t count = (n - base < BATCH_SIZE)? n - base: BATCH_SIZE;
+
+        for(size_t i = 0; i < count; i++) {
+            slots[i] = create_hash(keys[base+i]) & mask;
+            __builtin_prefetch(&tab->table[slots[i]]);
+        }
+
+        for(size_t i = 0; i < count; i++) {
+            heads[i] = __atomic_load_n(&tab->table[slots[i]], __ATOMIC_ACQUIRE);
+            if(heads[i] != NULL)
+                __builtin_prefetch(heads[i]);
+        }
+
+        for(size_t i = 0; i < count; i++) {
+            hash_entry_t* entry = find_in_chain(heads[i], keys[base+i]);
+            vals[base+i] = (entry != NULL)? __atomic_load_n(&entry->val, __ATOMIC_ACQUIRE): NULL;
+        }
+    }
+}
+
+/*
+ * Replace the value of an existing entry and return non-zero if the key was
+ * found. The old value is stored in old. A NULL value removes the entry but
+ * keeps the key so that it can be given a value again later.
+ *
+ * This does not change the structure of the table, so it is safe while
+ * other threads are reading the table. So is add_table_entry() for a key
+ * that is not in the table, as long as table_has_room() said so.
+ */
+int replace_table_entry(hash_table_t* tab, const char* key, void* val, void** old) {
+
+    hash_entry_t* entry = find_entry(tab, key);
+
+    if(entry == NULL)
+        return 0;
+
+    void* prev = __atomic_exchange_n(&entry->val, val, __ATOMIC_ACQ_REL);
+    if(prev == NULL && val != NULL)
+        tab->len++;
+    else if(prev != NULL && val == NULL)
+        tab->len--;
+
+    if(old != NULL)
+        *old = prev;
+
+    return 1;
+}
+
+/*
+ * Return non-zero if n entries can be added without rehashing the table or
+ * growing the order.
+ */
+int table_has_room(hash_table_t* tab, size_t n) {
+
+    return tab->len + n + MAX_HASH <= tab->cap && tab->norder + n <= tab->ordcap;
+}
+
+/*
+ * Make a new table with all of the entries that have a value. The values are
+ * shared with the original. The new table has room for extra more entries.
+ * The entries keep their places in the order, so marks from the original
+ * can be used with the copy.
+ */
+hash_table_t* copy_hash_table(hash_table_t* tab, size_t extra) {
+
+    hash_table_t* ntab = _ALLOC_DS(hash_table_t);
+    ntab->len = 0;
+    ntab->cap = tab->cap;
+    while(tab->len + extra + MAX_HASH > ntab->cap)
+        ntab->cap <<= 1;
+    ntab->table = _ALLOC_ARRAY(hash_entry_t*, ntab->cap);
+
+    ntab->ordcap = ntab->cap;
+    while(tab->norder + extra > ntab->ordcap)
+        ntab->ordcap <<= 1;
+    ntab->order = _ALLOC_ARRAY(hash_entry_t*, ntab->ordcap);
+    ntab->norder = tab->norder;
+
+    for(size_t i = 0; i < tab->norder; i++) {
+        hash_entry_t* crnt = tab->order[i];
+        if(crnt != NULL && crnt->key != NULL && crnt->val != NULL) {
+            hash_entry_t* entry = create_entry(crnt->key, crnt->val);
+            entry->pos = i;
+            ntab->order[i] = entry;
+            add_entry(ntab, entry);
+            ntab->len++;
+        }
+    }
+
+    return ntab;
+}
+
 /*
  * Remove a table entry by deleting the key. The actual memory will be freed
  * when the table is rehashed.
  */
 void remove_table_entry(hash_table_t* tab, const char* key) {
 
-    remove_entry(tab, key);
+    if(find_entry(tab, key) != NULL) {
+        remove_entry(tab, key);
+        tab->len--;
+    }
+}
+
+/*
+ * Return the hash value that the table uses for the key. This is used by
+ * things like the config cache that need to build a compatible index.
+ */
+size_t hash_key(const char* key) {
+
+    return create_hash(key);
+}
+
+/*
+ * Hash an arbitrary buffer with the 64 bit FNV-1a algorithm. This is used to
+ * tell if the contents of a file have changed.
+ */
+uint64_t hash_buffer(const void* buf, size_t len) {
+
+    const uint8_t* ptr = (const uint8_t*)buf;
+    uint64_t hash = 14695981039346656037ull;
+
+    for(size_t i = 0; i < len; i++) {
+        hash ^= ptr[i];
+        hash *= 1099511628211ull;
+    }
+
+    return hash;
 }
 
 /*
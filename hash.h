@@ -5,24 +5,39 @@
 #define _HASH_H_
 
 #include <stddef.h>
+#include <stdint.h>
 #include "strlist.h"
 
 typedef struct _hash_entry_ {
     const char* key;
     void* val;
     struct _hash_entry_* next;
+    size_t pos;         // index in the order array
 } hash_entry_t;
 
 typedef struct _hash_table_t_ {
     struct _hash_entry_** table;
     size_t len;
     size_t cap;
+
+    // every entry in the order it was added, NULL where one was freed
+    struct _hash_entry_** order;
+    size_t norder;
+    size_t ordcap;
 } hash_table_t;
 
 hash_table_t* create_hash_table(void);
 void destroy_hash_table(hash_table_t* tab);
 void add_table_entry(hash_table_t* tab, const char* key, void* val);
 void* find_table_entry(hash_table_t* tab, const char* key);
+void* iter_table_entry(hash_table_t* tab, size_t* mark, const char** key);
+void find_table_entries(hash_table_t* tab, const char** keys, void** vals, size_t n);
+void remove_table_entry(hash_table_t* tab, const char* key);
+int replace_table_entry(hash_table_t* tab, const char* key, void* val, void** old);
+int table_has_room(hash_table_t* tab, size_t n);
+hash_table_t* copy_hash_table(hash_table_t* tab, size_t extra);
 void dump_hash_table(hash_table_t* tab, void (*vdump)(void*));
+size_t hash_key(const char* key);
+uint64_t hash_buffer(const void* buf, size_t len);
 
 #endif /* _HASH_H_ */
@@ -7,6 +7,9 @@
 
 #include "memory.h"
 
+// allocations made by this thread, for the load statistics
+static _Thread_local size_t nallocs;
+
 void* mem_alloc(size_t size) {
     
     void* ptr = malloc(size);
@@ -14,6 +17,7 @@ void* mem_alloc(size_t size) {
         fprintf(stderr, "ERROR: Cannot allocate %lu bytes\n", size);
         exit(1);
     }
+    nallocs++;
     
     memset(ptr, 0, size);
     return ptr;
@@ -26,6 +30,8 @@ void* mem_realloc(void* ptr, size_t size) {
         fprintf(stderr, "ERROR: Cannot re-allocate %lu bytes\n", size);
         exit(1);
     }
+    if(ptr == NULL)
+        nallocs++;
     
     return nptr;
 }
@@ -37,6 +43,7 @@ void* mem_dup(void* ptr, size_t size) {
         fprintf(stderr, "ERROR: Cannot duplicate %lu bytes\n", size);
         exit(1);
     }
+    nallocs++;
 
     memmove(nptr, ptr, size);
     return nptr;
@@ -53,3 +60,12 @@ void mem_free(void* ptr) {
     if(ptr != NULL)
         free(ptr);
 }
+
+/*
+ * Return the number of blocks that this thread has allocated. A realloc()
+ * of an existing block is not counted.
+ */
+size_t mem_alloc_count(void) {
+
+    return nallocs;
+}
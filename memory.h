@@ -20,5 +20,6 @@ void* mem_realloc(void* ptr, size_t size);
 void* mem_dup(void* ptr, size_t size);
 char* mem_dup_str(const char* ptr);
 void mem_free(void* ptr);
+size_t mem_alloc_count(void);
 
 #endif /* _MEMORY_H_ */
@@ -13,30 +13,12 @@
 #include "str.h"
 #include "parse_file.h"
 #include "memory.h"
+#include "trace.h"
 
-#define FATAL(f, ...) do { \
-        fprintf(stderr, "ERROR: "); \
-        fprintf(stderr, f __VA_OPT__(,) __VA_ARGS__); \
-        fprintf(stderr, "\n"); \
-        exit(1); \
-    } while(0)
-
-#define ERROR(f, ...) do { \
-        fprintf(stderr, "ERROR: %s: %d: %d: ", get_fname(), get_line_no(), get_col_no()); \
-        fprintf(stderr, f __VA_OPT__(,) __VA_ARGS__); \
-        fprintf(stderr, "\n"); \
-    } while(0)
-
-#define EXPECTED(s) do { \
-        fprintf(stderr, "ERROR: %s: %d: %d: ", get_fname(), get_line_no(), get_col_no()); \
-        fprintf(stderr, "Expected %s but got a '%s'\n", (s), get_token()->str->buf); \
-    } while(0)
-
-#ifdef USE_TRACE
-#define TRACE fprintf(stderr, "state: %d %s\n", state, get_token()->str->buf)
-#else
-#define TRACE
-#endif
+// These only return when errors are being collected. See set_error_list().
+#define ERROR(f, ...) report_error(f __VA_OPT__(,) __VA_ARGS__)
+
+#define EXPECTED(s) report_error("Expected %s but got a '%s'", (s), get_token()->str->buf)
 
 typedef struct {
     string_t** list;
@@ -44,7 +26,7 @@ typedef struct {
     int cap;
 } context_t;
 
-static context_t* context;
+static _Thread_local context_t* context;
 
 static inline void push_context(string_t* name) {
 
@@ -64,13 +46,11 @@ static inline void pop_context(void) {
         destroy_string(context->list[context->len]);
         context->list[context->len] = NULL;
     }
-    else {
+    else
         ERROR("imbalanced '{}'");
-        FATAL("Context stack under-run");
-    }
 }
 
-static inline const char* context_name(string_t* name) {
+static inline string_t* context_name(string_t* name) {
 
     string_t* str = create_string(NULL);
 
@@ -85,7 +65,7 @@ static inline const char* context_name(string_t* name) {
 
     append_string_string(str, name);
 
-    return str->buf;
+    return str;
 }
 
 const char* find_config_file(config_t* cfg) {
@@ -109,16 +89,100 @@ const char* find_config_file(config_t* cfg) {
 }
 
 /*
- * Load the whole configuration file and deliver the result.
+ * Return non-zero if the other name is the same file as the path, which is
+ * already canonical. The other name can be relative or go through a
+ * symlink, so it is made canonical too.
  */
-void load_config_file(config_t* cfg) {
+static int same_file(const char* path, const char* other) {
+
+    if(other == NULL)
+        return 0;
+
+    char* canon = canonicalize_file_name(other);
+    int same = !strcmp(path, (canon != NULL)? canon: other);
+    free(canon);
+
+    return same;
+}
+
+/*
+ * Add a layer for the file if it exists and it is not already being used.
+ */
+static void add_layer_file(config_t* cfg, const char* fname, int upper) {
 
-    hash_table_t* table = cfg->vars;
-    const char* fname = find_config_file(cfg);
-    if(fname == NULL)
+    char* path = canonicalize_file_name(fname);
+    if(path == NULL)
         return;
 
-    init_scanner(fname);
+    int used = same_file(path, cfg->fname);
+    for(config_layer_t* ptr = cfg->upper; ptr != NULL; ptr = ptr->next)
+        used |= same_file(path, ptr->fname);
+    for(config_layer_t* ptr = cfg->lower; ptr != NULL; ptr = ptr->next)
+        used |= same_file(path, ptr->fname);
+
+    if(!used && !access(path, R_OK))
+        add_config_layer(cfg, path, upper);
+
+    free(path);
+}
+
+/*
+ * Find the optional files that are layered over and under the main one,
+ * where <name> is the name of the program. From the highest precedence to
+ * the lowest, they are:
+ *
+ *   ./<name>.cfg
+ *   $XDG_CONFIG_HOME/<name>.cfg, or ~/.config/<name>.cfg
+ *   the main file, <program>.cfg
+ *   /etc/<name>.cfg
+ *
+ * The environment and the command line override all of them. The files
+ * are only checked for here. They are read when a lookup gets to them.
+ */
+void find_config_layers(config_t* cfg) {
+
+    char buffer[256];
+    const char* name = strrchr(cfg->pname, '/');
+    name = (name != NULL)? name + 1: cfg->pname;
+
+    snprintf(buffer, sizeof(buffer), "%s.cfg", name);
+    add_layer_file(cfg, buffer, 1);
+
+    const char* xdg = getenv("XDG_CONFIG_HOME");
+    const char* home = getenv("HOME");
+    if(xdg != NULL && xdg[0] != '\0') {
+        snprintf(buffer, sizeof(buffer), "%s/%s.cfg", xdg, name);
+        add_layer_file(cfg, buffer, 1);
+    }
+    else if(home != NULL && home[0] != '\0') {
+        snprintf(buffer, sizeof(buffer), "%s/.config/%s.cfg", home, name);
+        add_layer_file(cfg, buffer, 1);
+    }
+
+    snprintf(buffer, sizeof(buffer), "/etc/%s.cfg", name);
+    add_layer_file(cfg, buffer, 0);
+}
+
+/*
+ * After a syntax error, skip to the next '}' or the first token on a line
+ * after the one that the error was on, and carry on from there.
+ */
+static void recover(void) {
+
+    token_t* tok = get_token();
+    int line = tok->line;
+
+    while(tok->type != TOK_END_OF_FILE && tok->type != TOK_CCBRACE && tok->line == line)
+        tok = consume_token();
+}
+
+/*
+ * Read tokens from the scanner until the end of the input and add the values
+ * to the table as CFG_FILE entries. If keys is not NULL then the names of the
+ * keys that were added are appended to it. If the table is NULL then the
+ * input is only checked.
+ */
+static void parse_tokens(hash_table_t* table, string_list_t* keys) {
 
     context = _ALLOC_DS(context_t);
     context->cap = 1 << 3;
@@ -127,15 +191,24 @@ void load_config_file(config_t* cfg) {
 
     int finished = 0;
     int state = 0;
+    config_load_stats_t* stats = get_load_stats();
 
     string_t* name = create_string(NULL);
 
     while(!finished) {
         token_t* tok = get_token();
+
+        if(tok->type == TOK_ERROR) {
+            // the scanner already reported it and skipped over it
+            clear_string(name);
+            consume_token();
+            state = 2;
+            continue;
+        }
+
         switch(state) {
 
             case 0:
-                TRACE;
                 // expecting a name or an error
                 if(tok->type == TOK_NAME) {
                     append_string_string(name, tok->str);
@@ -147,15 +220,34 @@ void load_config_file(config_t* cfg) {
                 }
                 else {
                     EXPECTED("a NAME");
-                    exit(1);
+                    recover();
+                    state = 2;
                 }
                 break;
 
             case 1:
-                TRACE;
                 // expecting a value or a '{'
-                if(tok->type == TOK_VALUE) {
-                    add_table_entry(table, context_name(name), copy_string(tok->str));
+                if(tok->type == TOK_VALUE || tok->type == TOK_ARRAY) {
+                    if(table != NULL) {
+                        string_t* key = context_name(name);
+                        if(keys != NULL && find_table_entry(table, key->buf) == NULL)
+                            append_string_list(keys, create_string(key->buf));
+                        config_entry_t* ent = create_config_entry(key->buf,
+                                copy_string(tok->str), CFG_FILE);
+                        if(tok->type == TOK_ARRAY) {
+                            // the entry takes the elements from the token
+                            ent->values = tok->items;
+                            tok->items = NULL;
+                        }
+                        size_t len = table->len;
+                        add_table_entry(table, key->buf, ent);
+                        destroy_string(key);
+                        if(stats != NULL) {
+                            stats->keys++;
+                            if(table->len == len)
+                                stats->overrides++;
+                        }
+                    }
                     clear_string(name);
                     consume_token();
                     state = 2;
@@ -168,12 +260,13 @@ void load_config_file(config_t* cfg) {
                 }
                 else {
                     EXPECTED("a VALUE or a '{'");
-                    exit(1);
+                    clear_string(name);
+                    recover();
+                    state = 2;
                 }
                 break;
 
             case 2:
-                TRACE;
                 // need a NAME or a '}'
                 if(tok->type == TOK_NAME) {
                     append_string_string(name, tok->str);
@@ -190,17 +283,378 @@ void load_config_file(config_t* cfg) {
                 }
                 else {
                     EXPECTED("a NAME or a '}'");
-                    exit(1);
+                    recover();
                 }
                 break;
         }
     }
 
-    if(context->len != 0) {
+    if(context->len != 0)
         ERROR("Unexpected end of file, imbalanced '{}'");
-        exit(1);
-    }
 
+    while(context->len)
+        pop_context();
+    destroy_string(name);
     _FREE(context->list);
     _FREE(context);
 }
+
+/*
+ * Same as the scanner. A value that is not quoted ends at one of these.
+ */
+static inline int is_value_stopper(int ch) {
+
+    return (ch == '{' || ch == '}' || ch == '=' || ch == ';' || ch == '\n');
+}
+
+/*
+ * Skip a quoted string that starts at pos. Return the position after the
+ * closing quote or zero if there is no closing quote.
+ */
+static size_t skip_string(const char* text, size_t len, size_t pos, int* line) {
+
+    char ender = text[pos++];
+
+    while(pos < len && text[pos] != ender) {
+        if(text[pos] == '\\' && pos+1 < len)
+            pos++;
+        if(text[pos] == '\n')
+            (*line)++;
+        pos++;
+    }
+
+    return (pos < len)? pos + 1: 0;
+}
+
+/*
+ * Skip an array that starts at pos. Return the position after the closing
+ * bracket or zero if there is no closing bracket.
+ */
+static size_t skip_array(const char* text, size_t len, size_t pos, int* line) {
+
+    for(pos++; pos < len && text[pos] != ']'; pos++) {
+        if(text[pos] == '\n')
+            (*line)++;
+        else if(text[pos] == ';') {
+            while(pos+1 < len && text[pos+1] != '\n')
+                pos++;
+        }
+        else if(text[pos] == '\"' || text[pos] == '\'') {
+            if((pos = skip_string(text, len, pos, line)) == 0)
+                return 0;
+            pos--;
+        }
+    }
+
+    return (pos < len)? pos + 1: 0;
+}
+
+/*
+ * Load the whole configuration file and deliver the result. For a lazy load
+ * the file is only divided into sections and the text is kept so that the
+ * sections can be parsed later. A section with the same name as another one
+ * is parsed now, because they can define the same keys.
+ */
+void load_config_file(config_t* cfg) {
+
+    if(cfg->fname == NULL)
+        return;
+    else if(!cfg->lazy) {
+        parse_config_file(cfg->fname, cfg->vars, &cfg->sections);
+        return;
+    }
+
+    size_t len;
+    char* text = read_input_file(cfg->fname, &len);
+    section_list_t* secs = create_section_list();
+
+    if(text == NULL || find_sections(text, len, secs)) {
+        destroy_section_list(secs);
+        _FREE(text);
+        parse_config_file(cfg->fname, cfg->vars, &cfg->sections);
+        return;
+    }
+
+    hash_table_t* pending = create_hash_table();
+    hash_table_t* dups = create_hash_table();
+
+    for(int i = 0; i < secs->len; i++) {
+        config_section_t* sec = &secs->list[i];
+        if(find_table_entry(pending, sec->name) != NULL)
+            add_table_entry(dups, sec->name, sec);
+        else
+            add_table_entry(pending, sec->name, sec);
+    }
+
+    for(int i = 0; i < secs->len; i++) {
+        config_section_t* sec = &secs->list[i];
+        if(find_table_entry(dups, sec->name) != NULL) {
+            parse_config_section(cfg->fname, text, sec, cfg->vars);
+            remove_table_entry(pending, sec->name);
+        }
+    }
+
+    destroy_hash_table(dups);
+    cfg->sections = secs;
+
+    if(pending->len > 0) {
+        cfg->text = text;
+        cfg->pending = pending;
+        cfg->npending = pending->len;
+    }
+    else {
+        destroy_hash_table(pending);
+        _FREE(text);
+    }
+}
+
+/*
+ * Add the time since the start to the statistics, if they are being kept.
+ */
+static inline void add_parse_time(uint64_t start) {
+
+    config_load_stats_t* stats = get_load_stats();
+    if(stats != NULL)
+        stats->parse_ns += get_trace_time() - start;
+}
+
+/*
+ * Parse the file and add everything in it to the table as CFG_FILE entries.
+ * If secs is not NULL then the file is parsed one top level section at a
+ * time and the list of sections is returned in it. That is NULL if the file
+ * could not be divided into sections.
+ */
+void parse_config_file(const char* fname, hash_table_t* table, section_list_t** secs) {
+
+    size_t len;
+    char* text = read_input_file(fname, &len);
+    if(text == NULL) {
+        add_error(fname, 0, 0, "Unable to open input file: %s", strerror(errno));
+        if(secs != NULL)
+            *secs = NULL;
+        return;
+    }
+
+    TRACE_BEGIN("parse_file");
+
+    section_list_t* list = NULL;
+    if(secs != NULL) {
+        list = create_section_list();
+        if(find_sections(text, len, list)) {
+            destroy_section_list(list);
+            list = NULL;
+        }
+    }
+
+    if(list != NULL) {
+        for(int i = 0; i < list->len; i++)
+            parse_config_section(fname, text, &list->list[i], table);
+        *secs = list;
+    }
+    else {
+        // let the parser find the problem and report it
+        TRACE_BEGIN("parse");
+        uint64_t start = (get_load_stats() != NULL)? get_trace_time(): 0;
+        init_scanner_buffer(fname, text, len, 0, 1);
+        parse_tokens(table, NULL);
+        close_scanner();
+        add_parse_time(start);
+        TRACE_END("parse", len);
+        if(secs != NULL)
+            *secs = NULL;
+    }
+
+    TRACE_END("parse_file", len);
+    _FREE(text);
+}
+
+/*
+ * Parse one section of the text of the file and add it to the table. The
+ * keys that it defines are recorded in the section.
+ */
+void parse_config_section(const char* fname, const char* text,
+                config_section_t* sec, hash_table_t* table) {
+
+    if(sec->keys == NULL)
+        sec->keys = create_string_list();
+
+    TRACE_BEGIN("parse");
+    uint64_t start = (get_load_stats() != NULL)? get_trace_time(): 0;
+    init_scanner_buffer(fname, &text[sec->start], sec->end - sec->start,
+                sec->start, sec->line);
+    parse_tokens(table, sec->keys);
+    close_scanner();
+    add_parse_time(start);
+    TRACE_END("parse", sec->end - sec->start);
+}
+
+/*
+ * Check the file for errors without storing anything. The errors are
+ * appended to the list and the number of them that were found in this file
+ * is returned. Many files can be checked with the same list.
+ */
+int check_config_file(const char* fname, config_errors_t* errs) {
+
+    config_errors_t* prev = set_error_list(errs);
+    int count = errs->len;
+
+    init_scanner(fname);
+    parse_tokens(NULL, NULL);
+    close_scanner();
+
+    set_error_list(prev);
+    return errs->len - count;
+}
+
+section_list_t* create_section_list(void) {
+
+    section_list_t* secs = _ALLOC_DS(section_list_t);
+    secs->cap = 1 << 3;
+    secs->len = 0;
+    secs->list = _ALLOC_ARRAY(config_section_t, secs->cap);
+
+    return secs;
+}
+
+void destroy_section_list(section_list_t* secs) {
+
+    if(secs != NULL) {
+        for(int i = 0; i < secs->len; i++) {
+            _FREE(secs->list[i].name);
+            destroy_string_list(secs->list[i].keys);
+        }
+        _FREE(secs->list);
+        _FREE(secs);
+    }
+}
+
+/*
+ * Divide the text into top level sections without tokenizing it. This
+ * follows the same rules as the scanner for comments, quoted strings and
+ * values, but only keeps track of the depth of the braces. The hash of the
+ * text of each section is recorded so that changes can be found. Return
+ * non-zero if the text is not well formed, and leave it to the parser to
+ * report the problem.
+ */
+static int scan_sections(const char* text, size_t len, section_list_t* secs) {
+
+    config_section_t* crnt = NULL;
+    size_t pos = 0;
+    int line = 1;
+    int depth = 0;
+
+    while(pos < len) {
+        int ch = (unsigned char)text[pos];
+
+        if(ch == '\n') {
+            line++;
+            pos++;
+        }
+        else if(isspace(ch))
+            pos++;
+        else if(ch == ';') {
+            while(pos < len && text[pos] != '\n')
+                pos++;
+        }
+        else if(ch == '{') {
+            if(crnt == NULL)
+                return 1;
+            depth++;
+            pos++;
+        }
+        else if(ch == '}') {
+            if(depth == 0)
+                return 1;
+            depth--;
+            pos++;
+            if(depth == 0) {
+                crnt->end = pos;
+                crnt = NULL;
+            }
+        }
+        else if(ch == '=') {
+            if(crnt == NULL)
+                return 1;
+
+            for(pos++; pos < len && isspace((unsigned char)text[pos]); pos++)
+                if(text[pos] == '\n')
+                    line++;
+
+            if(pos >= len || is_value_stopper(text[pos]))
+                return 1;
+            else if(text[pos] == '\"' || text[pos] == '\'') {
+                if((pos = skip_string(text, len, pos, &line)) == 0)
+                    return 1;
+            }
+            else if(text[pos] == '[') {
+                if((pos = skip_array(text, len, pos, &line)) == 0)
+                    return 1;
+            }
+            else {
+                while(pos < len && !is_value_stopper(text[pos])) {
+                    if(text[pos] == '$' && pos+1 < len && text[pos+1] == '{') {
+                        for(pos += 2; pos < len && text[pos] != '}' && text[pos] != '\n'; pos++)
+                            ;
+                        if(pos < len && text[pos] == '}')
+                            pos++;
+                    }
+                    else
+                        pos++;
+                }
+            }
+
+            if(depth == 0) {
+                crnt->end = pos;
+                crnt = NULL;
+            }
+        }
+        else if(isalpha(ch) || ch == '_') {
+            size_t start = pos;
+            while(pos < len && (isalpha((unsigned char)text[pos]) || text[pos] == '_'))
+                pos++;
+
+            if(depth == 0) {
+                if(crnt != NULL)
+                    return 1;
+
+                if(secs->len+1 > secs->cap) {
+                    secs->cap <<= 1;
+                    secs->list = _REALLOC_ARRAY(secs->list, config_section_t, secs->cap);
+                }
+
+                crnt = &secs->list[secs->len];
+                secs->len++;
+                crnt->name = _ALLOC(pos - start + 1);
+                memcpy(crnt->name, &text[start], pos - start);
+                crnt->start = start;
+                crnt->end = start;
+                crnt->line = line;
+                crnt->keys = NULL;
+            }
+        }
+        else
+            return 1;
+    }
+
+    if(depth != 0 || crnt != NULL)
+        return 1;
+
+    for(int i = 0; i < secs->len; i++)
+        secs->list[i].hash = hash_buffer(&text[secs->list[i].start],
+                    secs->list[i].end - secs->list[i].start);
+
+    return 0;
+}
+
+int find_sections(const char* text, size_t len, section_list_t* secs) {
+
+    TRACE_BEGIN("scan");
+    config_load_stats_t* stats = get_load_stats();
+    uint64_t start = (stats != NULL)? get_trace_time(): 0;
+    int err = scan_sections(text, len, secs);
+    if(stats != NULL)
+        stats->scan_ns += get_trace_time() - start;
+    TRACE_END("scan", len);
+
+    return err;
+}
@@ -5,10 +5,40 @@
 #ifndef _PARSE_FILE_H_
 #define _PARSE_FILE_H_
 
+#include <stdint.h>
+
 #include "hash.h"
+#include "strlist.h"
+#include "scan_file.h"
 #include "config.h"
 
+// A top level section of the file. That is a name with a block or a name
+// with a value that is not inside of a block.
+typedef struct _config_section_t_ {
+    char* name;
+    size_t start;           // byte range of the section in the file
+    size_t end;
+    int line;               // line number that the section starts on
+    uint64_t hash;          // hash of the text of the section
+    string_list_t* keys;    // keys that the section defines
+} config_section_t;
+
+typedef struct _section_list_t_ {
+    config_section_t* list;
+    int len;
+    int cap;
+} section_list_t;
+
 const char* find_config_file(config_t* cfg);
+void find_config_layers(config_t* cfg);
 void load_config_file(config_t* cfg);
+void parse_config_file(const char* fname, hash_table_t* table, section_list_t** secs);
+void parse_config_section(const char* fname, const char* text,
+                config_section_t* sec, hash_table_t* table);
+int check_config_file(const char* fname, config_errors_t* errs);
+
+section_list_t* create_section_list(void);
+void destroy_section_list(section_list_t* secs);
+int find_sections(const char* text, size_t len, section_list_t* secs);
 
 #endif /* _PARSE_FILE_H_ */
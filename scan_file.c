@@ -3,25 +3,41 @@
  */
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <errno.h>
 #include <ctype.h>
 #include <string.h>
-
-
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "scan_file.h"
 #include "memory.h"
+#include "trace.h"
+#include "config.h"
 
 typedef struct {
     const char* fname;
-    FILE* fp;
+    char* text;         // the whole file, if the scanner read it
+    const char* buf;    // the text that is being scanned
+    size_t len;
+    size_t pos;         // index of the current character in buf
+    size_t base;        // offset of buf in the file
     int line;
     int col;
     token_t tok;
     int ch;
 } scanner_t;
 
-static scanner_t* scanner;
+// Each thread has its own so that a reload in the background does not
+// interfere with anything else that is being parsed.
+static _Thread_local scanner_t* scanner;
+static _Thread_local config_errors_t* errors;
+static _Thread_local config_load_stats_t* stats;
+static _Thread_local int check_utf8;
 
 static int get_char(void) {
 
@@ -30,7 +46,7 @@ static int get_char(void) {
 
 static int consume_char(void) {
 
-    if(feof(scanner->fp))
+    if(scanner->ch == EOF)
         return scanner->ch;
     else if(scanner->ch == '\n') {
         scanner->line++;
@@ -39,10 +55,12 @@ static int consume_char(void) {
     else
         scanner->col++;
 
-    scanner->ch = fgetc(scanner->fp);
-    if(scanner->ch == EOF)
+    scanner->pos++;
+    if(scanner->pos < scanner->len)
+        scanner->ch = (unsigned char)scanner->buf[scanner->pos];
+    else
+        scanner->ch = EOF;
 
-        clear_string(scanner->tok.str);
     return scanner->ch;
 }
 
@@ -83,25 +101,248 @@ static void scan_name(void) {
     scanner->tok.type = TOK_NAME;
 }
 
-static void scan_string(void) {
+/*
+ * Move past n characters that are all on the current line.
+ */
+static inline void skip_chars(size_t n) {
 
-    int ch, ender = get_char();
-    ch = consume_char();
+    scanner->pos += n;
+    scanner->col += n;
+    if(scanner->pos < scanner->len)
+        scanner->ch = (unsigned char)scanner->buf[scanner->pos];
+    else
+        scanner->ch = EOF;
+}
 
-    while(ch != ender && ch != EOF) {
-        append_string_char(scanner->tok.str, ch);
-        ch = consume_char();
+/*
+ * Return the offset of the first quote that is the ender, backslash or
+ * newline at or after pos, or len. With SSE2, 16 bytes are compared with
+ * all three at once.
+ */
+static inline size_t find_string_stopper(const char* buf, size_t len, size_t pos, int ender) {
+
+#ifdef __SSE2__
+    __m128i quote = _mm_set1_epi8((char)ender);
+    __m128i slash = _mm_set1_epi8('\\');
+    __m128i nline = _mm_set1_epi8('\n');
+
+    for(; pos + 16 <= len; pos += 16) {
+        __m128i text = _mm_loadu_si128((const __m128i*)&buf[pos]);
+        __m128i hits = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(text, quote),
+                    _mm_cmpeq_epi8(text, slash)), _mm_cmpeq_epi8(text, nline));
+        int mask = _mm_movemask_epi8(hits);
+        if(mask != 0)
+            return pos + __builtin_ctz(mask);
     }
+#endif
 
-    if(ch == EOF) {
-        fprintf(stderr, "ERROR: %s: %d: %d: Unexpected end of file\n",
-                get_fname(), get_line_no(), get_col_no());
-        exit(1);
+    while(pos < len && buf[pos] != ender && buf[pos] != '\\' && buf[pos] != '\n')
+        pos++;
+
+    return pos;
+}
+
+/*
+ * Append the character as UTF-8.
+ */
+static void append_utf8(string_t* str, unsigned long cp) {
+
+    if(cp < 0x80)
+        append_string_char(str, cp);
+    else if(cp < 0x800) {
+        append_string_char(str, 0xC0 | (cp >> 6));
+        append_string_char(str, 0x80 | (cp & 0x3F));
+    }
+    else if(cp < 0x10000) {
+        append_string_char(str, 0xE0 | (cp >> 12));
+        append_string_char(str, 0x80 | ((cp >> 6) & 0x3F));
+        append_string_char(str, 0x80 | (cp & 0x3F));
     }
+    else {
+        append_string_char(str, 0xF0 | (cp >> 18));
+        append_string_char(str, 0x80 | ((cp >> 12) & 0x3F));
+        append_string_char(str, 0x80 | ((cp >> 6) & 0x3F));
+        append_string_char(str, 0x80 | (cp & 0x3F));
+    }
+}
+
+/*
+ * The current character is a backslash in a quoted string. Append what the
+ * escape sequence stands for. A backslash that does not start one of the
+ * sequences is kept as it is, so that something like "C:\dir" still works.
+ */
+static void scan_escape(string_t* str) {
+
+    int ch = consume_char();
+
+    switch(ch) {
+        case 'n': append_string_char(str, '\n'); break;
+        case 't': append_string_char(str, '\t'); break;
+        case 'r': append_string_char(str, '\r'); break;
+        case '\\':
+        case '\"':
+        case '\'':
+            append_string_char(str, ch);
+            break;
+        case 'u':
+        case 'U': {
+            // \uXXXX or \UXXXXXXXX, a code point in hex
+            int ndigits = (ch == 'u')? 4: 8;
+            unsigned long cp = 0;
+            for(int i = 0; i < ndigits; i++) {
+                int hex = consume_char();
+                if(!isxdigit(hex)) {
+                    report_error("Expected %d hex digits after '\\%c'", ndigits, ch);
+                    return;
+                }
+                cp = (cp << 4) | (isdigit(hex)? hex - '0': (tolower(hex) - 'a' + 10));
+            }
+            if(cp == 0 || cp > 0x10FFFF || (cp >= 0xD800 && cp <= 0xDFFF))
+                report_error("Invalid character in escape sequence: U+%04lX", cp);
+            else
+                append_utf8(str, cp);
+            break;
+        }
+        default:
+            append_string_char(str, '\\');
+            return;
+    }
+
+    consume_char();
+}
+
+/*
+ * Append the text of a quoted string to str, up to the quote that ends it.
+ * The current character is the opening quote. The text between escapes and
+ * newlines is found with one search and copied all at once, so a string
+ * without escapes costs little more than a memchr(). Returns the quote that
+ * ended it, which is the current character, or EOF.
+ */
+static int scan_quoted(string_t* str) {
+
+    int ender = get_char();
+    int ch = consume_char();
+
+    while(ch != ender && ch != EOF) {
+        size_t end = find_string_stopper(scanner->buf, scanner->len, scanner->pos, ender);
+        if(end > scanner->pos) {
+            append_string_mem(str, &scanner->buf[scanner->pos], end - scanner->pos);
+            skip_chars(end - scanner->pos);
+        }
+
+        ch = get_char();
+        if(ch == '\\') {
+            scan_escape(str);
+            ch = get_char();
+        }
+        else if(ch == '\n') {
+            append_string_char(str, ch);
+            ch = consume_char();
+        }
+    }
+
+    return ch;
+}
+
+static void scan_string(void) {
+
+    int ch = scan_quoted(scanner->tok.str);
+
+    if(ch == EOF)
+        report_error("Unexpected end of file");
     else
         consume_char();
 
-    //scanner->tok.type = TOK_QSTRG;
+    scanner->tok.type = TOK_QSTRG;
+}
+
+static int is_item_stopper(int ch) {
+
+    return (is_value_stopper(ch) || ch == ',' || ch == ']');
+}
+
+static int skip_array_space(void) {
+
+    int ch = get_char();
+
+    while(isspace(ch) || ch == ';') {
+        if(ch == ';')
+            consume_comment();
+        else
+            consume_char();
+        ch = get_char();
+    }
+
+    return ch;
+}
+
+/*
+ * Scan a list of values, like [80, 443, "a b"]. The list can extend across
+ * lines and have comments in it. The elements are kept in the token and the
+ * text of the token is the list with the elements separated by ", ".
+ */
+static void scan_array(void) {
+
+    destroy_string_list(scanner->tok.items);
+    scanner->tok.items = create_string_list();
+    append_string_char(scanner->tok.str, '[');
+    consume_char();
+
+    while(1) {
+        int ch = skip_array_space();
+
+        if(ch == ']')
+            break;
+        else if(ch == EOF) {
+            report_error("Expected a ']' but got EOF");
+            scanner->tok.type = TOK_ERROR;
+            return;
+        }
+
+        string_t* item = create_string(NULL);
+        if(ch == '\'' || ch == '\"') {
+            if(scan_quoted(item) == EOF) {
+                report_error("Unexpected end of file");
+                destroy_string(item);
+                scanner->tok.type = TOK_ERROR;
+                return;
+            }
+            consume_char();
+        }
+        else {
+            for(; !is_item_stopper(ch); ch = consume_char())
+                append_string_char(item, ch);
+            strip_string(item);
+
+            if(item->len == 0) {
+                report_error("Expected an array element but got '%c'", ch);
+                destroy_string(item);
+                scanner->tok.type = TOK_ERROR;
+                return;
+            }
+        }
+
+        if(scanner->tok.items->len > 0)
+            append_string_str(scanner->tok.str, ", ");
+        append_string_string(scanner->tok.str, item);
+        append_string_list(scanner->tok.items, item);
+
+        ch = skip_array_space();
+        if(ch == ',')
+            consume_char();
+        else if(ch != ']') {
+            if(ch == EOF)
+                report_error("Expected a ',' or a ']' but got EOF");
+            else
+                report_error("Expected a ',' or a ']' but got '%c'", ch);
+            scanner->tok.type = TOK_ERROR;
+            return;
+        }
+    }
+
+    append_string_char(scanner->tok.str, ']');
+    consume_char();
+    scanner->tok.type = TOK_ARRAY;
 }
 
 static void scan_value(void) {
@@ -113,22 +354,40 @@ static void scan_value(void) {
     }
 
     if(ch == EOF) {
-        fprintf(stderr, "ERROR: %s: %d: %d: Expected a value but got EOF\n",
-                    get_fname(), get_line_no(), get_col_no());
-        exit(1);
+        report_error("Expected a value but got EOF");
+        scanner->tok.type = TOK_ERROR;
+        return;
     }
     else if(is_value_stopper(ch)) {
-        fprintf(stderr, "ERROR: %s: %d: %d: Expected a value but got '%c'\n",
-                    get_fname(), get_line_no(), get_col_no(), ch);
-        exit(1);
+        report_error("Expected a value but got '%c'", ch);
+        scanner->tok.type = TOK_ERROR;
+        return;
     }
 
-    if(ch == '\'' || ch == '\"')
+    if(ch == '[') {
+        scan_array();
+        return;
+    }
+    else if(ch == '\'' || ch == '\"')
         scan_string();
     else {
         while(!is_value_stopper(ch)) {
+            int prev = ch;
             append_string_char(scanner->tok.str, ch);
             ch = consume_char();
+
+            // a reference to another value, like ${bacon.eggs}, has braces
+            // in it that do not end the value
+            if(prev == '$' && ch == '{') {
+                while(ch != '}' && ch != '\n' && ch != EOF) {
+                    append_string_char(scanner->tok.str, ch);
+                    ch = consume_char();
+                }
+                if(ch == '}') {
+                    append_string_char(scanner->tok.str, ch);
+                    ch = consume_char();
+                }
+            }
         }
         strip_string(scanner->tok.str);
     }
@@ -136,45 +395,231 @@ static void scan_value(void) {
     scanner->tok.type = TOK_VALUE;
 }
 
+/*
+ * Return the offset of the first byte at or after pos that is not ASCII, or
+ * len. With SSE2 the high bits of 16 bytes are tested at once.
+ */
+static inline size_t skip_ascii(const unsigned char* buf, size_t len, size_t pos) {
+
+#ifdef __SSE2__
+    for(; pos + 16 <= len; pos += 16) {
+        int mask = _mm_movemask_epi8(_mm_loadu_si128((const __m128i*)&buf[pos]));
+        if(mask != 0)
+            return pos + __builtin_ctz(mask);
+    }
+#endif
+
+    while(pos < len && buf[pos] < 0x80)
+        pos++;
+
+    return pos;
+}
+
+/*
+ * Return the length of the UTF-8 sequence that starts with a byte that is not
+ * ASCII, or 0 if it is not valid. Overlong forms, surrogates and code points
+ * past U+10FFFF are not valid.
+ */
+static inline int utf8_length(const unsigned char* ptr, size_t avail) {
+
+    int len;
+    unsigned char lo = 0x80, hi = 0xBF;
+
+    if(ptr[0] < 0xC2)
+        return 0;
+    else if(ptr[0] < 0xE0)
+        len = 2;
+    else if(ptr[0] < 0xF0) {
+        len = 3;
+        if(ptr[0] == 0xE0)
+            lo = 0xA0;
+        else if(ptr[0] == 0xED)
+            hi = 0x9F;
+    }
+    else if(ptr[0] < 0xF5) {
+        len = 4;
+        if(ptr[0] == 0xF0)
+            lo = 0x90;
+        else if(ptr[0] == 0xF4)
+            hi = 0x8F;
+    }
+    else
+        return 0;
+
+    if(avail < (size_t)len || ptr[1] < lo || ptr[1] > hi)
+        return 0;
+    for(int i = 2; i < len; i++)
+        if((ptr[i] & 0xC0) != 0x80)
+            return 0;
+
+    return len;
+}
+
+/*
+ * Report the first sequence in the text that is not valid UTF-8. The text is
+ * mostly ASCII, so the runs of ASCII are skipped a block at a time and only
+ * the other bytes are decoded. The column counts characters, not bytes.
+ * Return non-zero if there was one.
+ */
+static int validate_utf8(const char* fname, const char* text, size_t len) {
+
+    const unsigned char* buf = (const unsigned char*)text;
+    size_t pos = 0;
+
+    while((pos = skip_ascii(buf, len, pos)) < len) {
+        int n = utf8_length(&buf[pos], len - pos);
+        if(n == 0)
+            break;
+        pos += n;
+    }
+
+    if(pos >= len)
+        return 0;
+
+    int line = 1;
+    size_t bol = 0;
+    for(const char* nl = text; NULL != (nl = memchr(nl, '\n', &text[pos] - nl)); nl++) {
+        line++;
+        bol = nl - text + 1;
+    }
+
+    int col = 1;
+    for(size_t i = bol; i < pos; i++)
+        if((buf[i] & 0xC0) != 0x80)
+            col++;
+
+    add_error(fname, line, col, "Invalid UTF-8 byte 0x%02x", buf[pos]);
+    return 1;
+}
+
 /*
  * Functions below this point are public interface. Ones above this point are
  * private implementation.
  */
 
+/*
+ * Read the whole file into memory. The buffer is terminated so that it can
+ * be treated as a string. Return NULL if the file cannot be read.
+ */
+char* read_input_file(const char* fname, size_t* len) {
+
+    struct stat st;
+    int fd = open(fname, O_RDONLY);
+    if(fd < 0)
+        return NULL;
+
+    TRACE_BEGIN("read");
+    uint64_t start = (stats != NULL)? get_trace_time(): 0;
+    if(fstat(fd, &st)) {
+        close(fd);
+        TRACE_END("read", 0);
+        return NULL;
+    }
+
+    char* text = _ALLOC(st.st_size + 1);
+    size_t done = 0;
+    while(done < (size_t)st.st_size) {
+        ssize_t n = read(fd, &text[done], st.st_size - done);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            break;
+        done += n;
+    }
+    close(fd);
+
+    text[done] = '\0';
+    *len = done;
+    if(check_utf8)
+        validate_utf8(fname, text, done);
+    if(stats != NULL) {
+        stats->scan_ns += get_trace_time() - start;
+        stats->bytes_read += done;
+    }
+    TRACE_END("read", done);
+    return text;
+}
+
 /*
  * Initialize the scanner. This must be called before reading any characters.
  */
 void init_scanner(const char* fname) {
 
-    FILE* fp = fopen(fname, "r");
-    if(fp == NULL) {
-        fprintf(stderr, "ERROR: Unable to open input file %s: %s\n",
-                fname, strerror(errno));
-        exit(1);
+    size_t len;
+    char* text = read_input_file(fname, &len);
+    if(text == NULL) {
+        add_error(fname, 0, 0, "Unable to open input file: %s", strerror(errno));
+        text = _DUP_STR("");
+        len = 0;
     }
 
+    init_scanner_buffer(fname, text, len, 0, 1);
+    scanner->text = text;
+}
+
+/*
+ * Initialize the scanner to read part of a file that is already in memory.
+ * The base is the offset of the buffer in the file and the line is the line
+ * number that the buffer starts on. The buffer belongs to the caller and
+ * must not change until the scanner is closed.
+ */
+void init_scanner_buffer(const char* fname, const char* buf, size_t len, size_t base, int line) {
+
     scanner = _ALLOC_DS(scanner_t);
-    scanner->fp = fp;
     scanner->fname = _DUP_STR(fname);
-    scanner->line = 1;
+    scanner->text = NULL;
+    scanner->buf = buf;
+    scanner->len = len;
+    scanner->pos = 0;
+    scanner->base = base;
+    scanner->line = line;
     scanner->col = 1;
     scanner->tok.str = create_string(NULL);
+    scanner->tok.items = NULL;
     scanner->tok.type = TOK_NO_TOKEN;
-    scanner->ch = fgetc(fp);
+    scanner->ch = (len > 0)? (unsigned char)buf[0]: EOF;
 
     consume_token();
 }
 
+/*
+ * Free the scanner. Must be called when the file has been completely read.
+ */
+void close_scanner(void) {
+
+    if(scanner != NULL) {
+        _FREE(scanner->text);
+        _FREE(scanner->fname);
+        destroy_string(scanner->tok.str);
+        destroy_string_list(scanner->tok.items);
+        _FREE(scanner);
+        scanner = NULL;
+    }
+}
+
+/*
+ * Return a pointer to the text at the given offset in the file. The offset
+ * must be inside of the text that is being scanned.
+ */
+const char* get_text(size_t offset) {
+
+    return &scanner->buf[offset - scanner->base];
+}
+
 /*
  * Dispose of the current token and get the next one. Return a pointer to it.
  */
 token_t* consume_token(void) {
 
     clear_string(scanner->tok.str);
+    destroy_string_list(scanner->tok.items);
+    scanner->tok.items = NULL;
     int finished = 0;
 
     while(!finished) {
         int ch = get_char();
+        scanner->tok.start = scanner->base + scanner->pos;
+        scanner->tok.line = scanner->line;
         switch(ch) {
             case EOF:
                 scanner->tok.type = TOK_END_OF_FILE;
@@ -210,6 +655,12 @@ token_t* consume_token(void) {
                     consume_char();
                     break;
                 }
+                else if(is_name_stopper(ch)) {
+                    report_error("Unexpected character '%c'", ch);
+                    consume_char();
+                    scanner->tok.type = TOK_ERROR;
+                    finished++;
+                }
                 else {
                     scan_name();
                     finished++;
@@ -218,6 +669,9 @@ token_t* consume_token(void) {
         }
     }
 
+    scanner->tok.end = scanner->base + scanner->pos;
+    if(stats != NULL)
+        stats->tokens++;
     return &scanner->tok;
 }
 
@@ -253,6 +707,137 @@ const char* get_fname(void) {
     return scanner->fname;
 }
 
+config_errors_t* create_error_list(void) {
+
+    config_errors_t* errs = _ALLOC_DS(config_errors_t);
+    errs->cap = 1 << 3;
+    errs->len = 0;
+    errs->list = _ALLOC_ARRAY(config_error_t, errs->cap);
+
+    return errs;
+}
+
+void destroy_error_list(config_errors_t* errs) {
+
+    if(errs != NULL) {
+        clear_error_list(errs);
+        _FREE(errs->list);
+        _FREE(errs);
+    }
+}
+
+/*
+ * Remove all of the errors so the list can be used again.
+ */
+void clear_error_list(config_errors_t* errs) {
+
+    for(int i = 0; i < errs->len; i++) {
+        _FREE(errs->list[i].fname);
+        _FREE(errs->list[i].msg);
+    }
+    errs->len = 0;
+}
+
+/*
+ * Print all of the errors to stderr, with the level such as "ERROR" or
+ * "WARNING" in front of each one.
+ */
+void print_error_list(config_errors_t* errs, const char* level) {
+
+    for(int i = 0; i < errs->len; i++)
+        fprintf(stderr, "%s: %s: %d: %d: %s\n", level, errs->list[i].fname,
+                    errs->list[i].line, errs->list[i].col, errs->list[i].msg);
+}
+
+/*
+ * Collect errors in the list from now on instead of stopping at the first
+ * one. If the list is NULL then errors are fatal again. Returns the list that
+ * was being used before.
+ */
+config_errors_t* set_error_list(config_errors_t* errs) {
+
+    config_errors_t* prev = errors;
+    errors = errs;
+
+    return prev;
+}
+
+/*
+ * When on is set, files that are read by this thread are checked for text
+ * that is not valid UTF-8 and the first place that has some is reported as
+ * an error. Returns the setting that was being used before.
+ */
+int set_utf8_check(int on) {
+
+    int prev = check_utf8;
+    check_utf8 = on;
+
+    return prev;
+}
+
+/*
+ * Count what the scanner and the parser do in the statistics from now on. If
+ * they are NULL then nothing is counted. Returns the ones that were being
+ * used before.
+ */
+config_load_stats_t* set_load_stats(config_load_stats_t* st) {
+
+    config_load_stats_t* prev = stats;
+    stats = st;
+
+    return prev;
+}
+
+config_load_stats_t* get_load_stats(void) {
+
+    return stats;
+}
+
+/*
+ * Report an error at the given place. If errors are not being collected then
+ * this does not return.
+ */
+void add_error(const char* fname, int line, int col, const char* fmt, ...) {
+
+    char msg[256];
+    va_list args;
+
+    va_start(args, fmt);
+    vsnprintf(msg, sizeof(msg), fmt, args);
+    va_end(args);
+
+    if(errors == NULL) {
+        fprintf(stderr, "ERROR: %s: %d: %d: %s\n", fname, line, col, msg);
+        exit(1);
+    }
+
+    if(errors->len+1 > errors->cap) {
+        errors->cap <<= 1;
+        errors->list = _REALLOC_ARRAY(errors->list, config_error_t, errors->cap);
+    }
+
+    errors->list[errors->len].fname = _DUP_STR(fname);
+    errors->list[errors->len].line = line;
+    errors->list[errors->len].col = col;
+    errors->list[errors->len].msg = _DUP_STR(msg);
+    errors->len++;
+}
+
+/*
+ * Report an error at the current place in the input.
+ */
+void report_error(const char* fmt, ...) {
+
+    char msg[256];
+    va_list args;
+
+    va_start(args, fmt);
+    vsnprintf(msg, sizeof(msg), fmt, args);
+    va_end(args);
+
+    add_error(get_fname(), get_line_no(), get_col_no(), "%s", msg);
+}
+
 /*
  * Below here is code to test the scanner.
  */
@@ -268,6 +853,8 @@ static const char* type_to_str(int type) {
     (type == TOK_OCBRACE)? "TOK_OCBRACE":
     (type == TOK_CCBRACE)? "TOK_CCBRACE":
     (type == TOK_QSTRG)? "TOK_QSTRG":
+    (type == TOK_ARRAY)? "TOK_ARRAY":
+    (type == TOK_ERROR)? "TOK_ERROR":
     (type == TOK_END_OF_FILE)? "TOK_END_OF_FILE": "UNKNOWN";
 }
 
@@ -4,7 +4,12 @@
 #ifndef _SCAN_FILE_H_
 #define _SCAN_FILE_H_
 
+#include <stddef.h>
+
 #include "str.h"
+#include "strlist.h"
+
+struct _config_load_stats_t_;
 
 typedef enum {
     TOK_NO_TOKEN,
@@ -14,15 +19,51 @@ typedef enum {
     TOK_OCBRACE,    // the '{' character
     TOK_CCBRACE,    // the '}' character
     TOK_QSTRG,      // anything between a pair of \" or \'
+    TOK_ARRAY,      // a list of values between '[' and ']'
+    TOK_ERROR,      // something that could not be scanned, already reported
     TOK_END_OF_FILE, // end of input
 } token_type_t;
 
 typedef struct _token_t_ {
     string_t* str;
+    string_list_t* items;   // the elements of a TOK_ARRAY
     token_type_t type;
+    size_t start;   // offset of the first character of the token in the file
+    size_t end;     // offset just past the last character
+    int line;       // line that the token starts on
 } token_t;
 
+typedef struct _config_error_t_ {
+    char* fname;
+    int line;
+    int col;
+    char* msg;
+} config_error_t;
+
+// Errors are collected in one of these instead of ending the program when
+// it has been given to set_error_list().
+typedef struct _config_errors_t_ {
+    config_error_t* list;
+    int len;
+    int cap;
+} config_errors_t;
+
+config_errors_t* create_error_list(void);
+void destroy_error_list(config_errors_t* errs);
+void clear_error_list(config_errors_t* errs);
+void print_error_list(config_errors_t* errs, const char* level);
+config_errors_t* set_error_list(config_errors_t* errs);
+int set_utf8_check(int on);
+void add_error(const char* fname, int line, int col, const char* fmt, ...);
+void report_error(const char* fmt, ...);
+struct _config_load_stats_t_* set_load_stats(struct _config_load_stats_t_* stats);
+struct _config_load_stats_t_* get_load_stats(void);
+
+char* read_input_file(const char* fname, size_t* len);
 void init_scanner(const char* fname);
+void init_scanner_buffer(const char* fname, const char* buf, size_t len, size_t base, int line);
+void close_scanner(void);
+const char* get_text(size_t offset);
 token_t* get_token(void);
 token_t* consume_token(void);
 int get_line_no(void);
@@ -0,0 +1,96 @@
+/*
+ * Compile time schema implementation.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "schema.h"
+
+/*
+ * Convert the text of a BOOL value. It has to be "true" or "false".
+ */
+static int convert_bool(const char* name, const char* str) {
+
+    if(str == NULL || !strcasecmp(str, "false"))
+        return 0;
+    else if(!strcasecmp(str, "true"))
+        return 1;
+
+    fprintf(stderr, "WARNING: Config value %s = \"%s\" is not true or false\n", name, str);
+    return 0;
+}
+
+/*
+ * Register the schema with the configuration. The options that it has are
+ * added to the command line, and the struct at dest is filled in when the
+ * configuration is loaded. Must be called before load_configuration().
+ */
+void add_config_schema(config_t* cfg, const config_schema_t* schema, void* dest) {
+
+    cfg->schema = schema;
+    cfg->schema_dest = dest;
+
+    for(const config_schema_t* row = schema; row->type != CFG_SCHEMA_END; row++) {
+        int opts = (row->short_opt != 0 || row->long_opt != NULL);
+        cmdline_type_t flags = row->flags;
+
+        // a list option takes a list
+        if(row->type == CFG_SCHEMA_LIST && opts)
+            flags |= CMD_LIST;
+
+        if(row->type == CFG_SCHEMA_OPT || row->type == CFG_SCHEMA_DIV ||
+                    opts || (flags & CMD_LIST))
+            add_cmdline(cfg, row->short_opt, row->long_opt, row->name, row->help,
+                        row->def_val, row->cb, flags);
+    }
+}
+
+/*
+ * Copy the current values into the struct. A name that is not defined gets
+ * the default value from the schema. Strings point at the values in the
+ * configuration, so a program that reloads it should call this again from a
+ * reload callback. The callbacks run without the lock held, so this can
+ * read values from layers and the environment there.
+ */
+void fill_config_schema(config_t* cfg) {
+
+    for(const config_schema_t* row = cfg->schema; row->type != CFG_SCHEMA_END; row++) {
+        if(row->name == NULL)
+            continue;
+
+        void* field = (char*)cfg->schema_dest + row->offset;
+        const char* str = get_config_str(row->name);
+        int found = (str != NULL);
+
+        if(!found)
+            str = row->def_val;
+
+        switch(row->type) {
+            case CFG_SCHEMA_STR:
+                *(const char**)field = str;
+                break;
+            case CFG_SCHEMA_INTEGER:
+                *(long*)field = (found)? get_config_integer(row->name):
+                                (str != NULL)? strtol(str, NULL, 0): 0;
+                break;
+            case CFG_SCHEMA_UNSIGNED:
+                *(unsigned long*)field = (found)? get_config_unsigned(row->name):
+                                (str != NULL)? strtoul(str, NULL, 0): 0;
+                break;
+            case CFG_SCHEMA_FLOAT:
+                *(double*)field = (found)? get_config_float(row->name):
+                                (str != NULL)? strtod(str, NULL): 0.0;
+                break;
+            case CFG_SCHEMA_BOOL:
+                *(int*)field = convert_bool(row->name, str);
+                break;
+            case CFG_SCHEMA_LIST:
+                *(int*)field = (found)? get_config_array_len(row->name): (str != NULL);
+                break;
+            default:
+                break;
+        }
+    }
+}
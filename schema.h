@@ -0,0 +1,117 @@
+/*
+ * Compile time schema public interface.
+ *
+ * The keys that a program uses are declared once as a list of rows, and the
+ * list is used to make a plain struct that holds the values, a table that
+ * describes the struct, and the command line options. The struct is filled
+ * in by load_configuration(), so a hot path can read a field without any
+ * lookup at all.
+ *
+ *  #define MY_SCHEMA(VAL, OPT, DIV) \
+ *      VAL(port, "port", INTEGER, "8080", 'p', "port", "the port to use", CMD_ARGS) \
+ *      VAL(bacon_number, "bacon.number", UNSIGNED, "0", 0, NULL, NULL, 0) \
+ *      DIV() \
+ *      OPT('h', "help", "print this help text", cb_cmdline_help)
+ *
+ *  CONFIG_SCHEMA_STRUCT(my_config_t, MY_SCHEMA);
+ *  CONFIG_SCHEMA_TABLE(my_schema, my_config_t, MY_SCHEMA)
+ *
+ *  my_config_t settings;
+ *  add_config_schema(cfg, my_schema(), &settings);
+ *
+ * A VAL is the struct field, the config name, the type, the default value,
+ * and then the same short option, long option, help and flags that are
+ * given to add_cmdline(). The type is one of STR, INTEGER, UNSIGNED, FLOAT,
+ * BOOL or LIST, and the matching CMD_ type flag is added for it. A value that
+ * has no options and is not a CMD_LIST is not on the command line.
+ *
+ * The field of a LIST is the number of elements, which are read with
+ * get_config_array_item(). The elements are CMD_STR unless the flags have
+ * CMD_NUM or CMD_BOOL. A LIST with options takes a list on the command line.
+ * One without options only comes from the files, unless the flags have
+ * CMD_LIST, which makes it take the arguments that are not options.
+ */
+#ifndef _SCHEMA_H_
+#define _SCHEMA_H_
+
+#include <stddef.h>
+
+#include "config.h"
+#include "cmdline.h"
+
+typedef enum {
+    CFG_SCHEMA_END = 0,
+    CFG_SCHEMA_STR,
+    CFG_SCHEMA_INTEGER,
+    CFG_SCHEMA_UNSIGNED,
+    CFG_SCHEMA_FLOAT,
+    CFG_SCHEMA_BOOL,
+    CFG_SCHEMA_LIST,
+    CFG_SCHEMA_OPT,     // a command option with a callback and no value
+    CFG_SCHEMA_DIV,     // a divider on the help screen
+} config_schema_type_t;
+
+typedef struct _config_schema_t_ {
+    config_schema_type_t type;
+    const char* name;
+    size_t offset;      // of the field in the struct
+    const char* def_val;
+    int short_opt;
+    const char* long_opt;
+    const char* help;
+    cmdline_callback_t cb;
+    cmdline_type_t flags;
+} config_schema_t;
+
+#define SCHEMA_CTYPE_STR const char*
+#define SCHEMA_CTYPE_INTEGER long
+#define SCHEMA_CTYPE_UNSIGNED unsigned long
+#define SCHEMA_CTYPE_FLOAT double
+#define SCHEMA_CTYPE_BOOL int
+#define SCHEMA_CTYPE_LIST int
+
+#define SCHEMA_CMD_STR(flg) CMD_STR
+#define SCHEMA_CMD_INTEGER(flg) CMD_NUM
+#define SCHEMA_CMD_UNSIGNED(flg) CMD_NUM
+#define SCHEMA_CMD_FLOAT(flg) CMD_NUM
+#define SCHEMA_CMD_BOOL(flg) CMD_BOOL
+#define SCHEMA_CMD_LIST(flg) (((flg) & (CMD_NUM|CMD_BOOL))? 0: CMD_STR)
+
+#define SCHEMA_FIELD(field, nm, tp, def, sopt, lopt, hlp, flg) \
+    SCHEMA_CTYPE_##tp field;
+#define SCHEMA_NO_FIELD(...)
+
+#define SCHEMA_VAL_ROW(field, nm, tp, def, sopt, lopt, hlp, flg) \
+    { CFG_SCHEMA_##tp, (nm), offsetof(schema_struct_t, field), (def), \
+      (sopt), (lopt), (hlp), NULL, (flg)|SCHEMA_CMD_##tp(flg) },
+#define SCHEMA_OPT_ROW(sopt, lopt, hlp, callback) \
+    { CFG_SCHEMA_OPT, NULL, 0, NULL, (sopt), (lopt), (hlp), (callback), CMD_NONE },
+#define SCHEMA_DIV_ROW() \
+    { CFG_SCHEMA_DIV, NULL, 0, NULL, 0, NULL, NULL, NULL, CMD_DIV },
+
+/*
+ * Declare the struct that holds the values.
+ */
+#define CONFIG_SCHEMA_STRUCT(tname, schema) \
+    typedef struct { \
+        schema(SCHEMA_FIELD, SCHEMA_NO_FIELD, SCHEMA_NO_FIELD) \
+    } tname
+
+/*
+ * Define a function that returns the table that describes the struct. The
+ * typedef is what lets the rows find the offsets of their fields.
+ */
+#define CONFIG_SCHEMA_TABLE(func, tname, schema) \
+    const config_schema_t* func(void) { \
+        typedef tname schema_struct_t; \
+        static const config_schema_t table[] = { \
+            schema(SCHEMA_VAL_ROW, SCHEMA_OPT_ROW, SCHEMA_DIV_ROW) \
+            { CFG_SCHEMA_END, NULL, 0, NULL, 0, NULL, NULL, NULL, CMD_NONE } \
+        }; \
+        return table; \
+    }
+
+void add_config_schema(config_t* cfg, const config_schema_t* schema, void* dest);
+void fill_config_schema(config_t* cfg);
+
+#endif /* _SCHEMA_H_ */
@@ -25,13 +25,28 @@ string_t* create_string(const char* str) {
     return ptr;
 }
 
+/*
+ * Create a string that refers to text that it does not own, such as text in
+ * a mapped file. It must not be appended to, and destroying it does not free
+ * the text. The text must be terminated at len.
+ */
+string_t* create_string_view(const char* buf, int len) {
+
+    string_t* ptr = _ALLOC_DS(string_t);
+    ptr->buf = (char*)buf;
+    ptr->len = len;
+    ptr->cap = 0;
+
+    return ptr;
+}
+
 /*
  * Free the memory associated with the string.
  */
 void destroy_string(string_t* str) {
 
     if(str != NULL) {
-        if(str->buf != NULL)
+        if(str->buf != NULL && str->cap > 0)
             _FREE(str->buf);
         _FREE(str);
     }
@@ -42,7 +57,7 @@ void destroy_string(string_t* str) {
  */
 void append_string_char(string_t* ptr, int ch) {
 
-    if(ptr->len+1 > ptr->cap) {
+    if(ptr->len+2 > ptr->cap) {
         ptr->cap <<= 1;
         ptr->buf = _REALLOC_ARRAY(ptr->buf, char, ptr->cap);
     }
@@ -53,19 +68,28 @@ void append_string_char(string_t* ptr, int ch) {
 }
 
 /*
- * Append a native string to the string.
+ * Append len bytes from the buffer to the string. The buffer does not have
+ * to be terminated.
  */
-void append_string_str(string_t* ptr, const char* str) {
+void append_string_mem(string_t* ptr, const char* buf, int len) {
 
-    int len = strlen(str);
     if(ptr->len+len+1 > ptr->cap) {
         while(ptr->len+len+1 > ptr->cap)
             ptr->cap <<= 1;
         ptr->buf = _REALLOC_ARRAY(ptr->buf, char, ptr->cap);
     }
 
-    memcpy(&ptr->buf[ptr->len], str, len+1);
+    memcpy(&ptr->buf[ptr->len], buf, len);
     ptr->len += len;
+    ptr->buf[ptr->len] = '\0';
+}
+
+/*
+ * Append a native string to the string.
+ */
+void append_string_str(string_t* ptr, const char* str) {
+
+    append_string_mem(ptr, str, strlen(str));
 }
 
 /*
@@ -7,14 +7,16 @@
 typedef struct _string_t_ {
     char* buf;
     int len;
-    int cap;
+    int cap;            // 0 if buf is not owned by the string
 } string_t;
 
 string_t* create_string(const char* str);
+string_t* create_string_view(const char* buf, int len);
 void destroy_string(string_t* str);
 
 void append_string_char(string_t* ptr, int ch);
 void append_string_str(string_t* ptr, const char* str);
+void append_string_mem(string_t* ptr, const char* buf, int len);
 void append_string_string(string_t* ptr, string_t* str);
 
 void clear_string(string_t* str);
@@ -24,6 +24,7 @@ void destroy_string_list(string_list_t* lst) {
         string_t* ptr;
         while(NULL != (ptr = iter_string_list(lst, &mark))) 
             destroy_string(ptr);
+        _FREE(lst->list);
         _FREE(lst);
     }
 }
@@ -5,26 +5,50 @@
 
 #include "config.h"
 #include "cmdline.h"
+#include "schema.h"
+
+#define TEST_SCHEMA(VAL, OPT, DIV) \
+    VAL(port, "port", INTEGER, "8080", 'p', NULL, "the port number to use", CMD_ARGS|CMD_REQD) \
+    VAL(ipaddr, "ipaddr", STR, "localhost", 'i', "ipaddr", "the IP address to use", CMD_ARGS) \
+    VAL(xtra, "xtra", LIST, "blart", 0, "xtra", "this is the extra parameter", CMD_NUM|CMD_LIST) \
+    DIV() \
+    VAL(verbosity, "verbosity", INTEGER, "0", 'v', "verbosity", "show progress as program executes", CMD_ARGS) \
+    OPT('V', "version", "print the program version", cb_cmdline_vers) \
+    OPT('h', "help", "print this help text", cb_cmdline_help) \
+    DIV() \
+    VAL(files, "files", LIST, NULL, 0, NULL, "list of files to be processed", CMD_REQD|CMD_LIST)
+
+CONFIG_SCHEMA_STRUCT(test_config_t, TEST_SCHEMA);
+CONFIG_SCHEMA_TABLE(test_schema, test_config_t, TEST_SCHEMA)
+
+static test_config_t settings;
 
 int main(int argc, char** argv, char** envp) {
 
     config_t* cfg = init_configuration("Config Test",
         "This is the test program for the configuration loader", "0.0.0.0.1");
 
+    add_config_schema(cfg, test_schema(), &settings);
 
-    add_cmdline(cfg, 'p', NULL, "port", "the port number to use", "8080", NULL, CMD_NUM|CMD_ARGS|CMD_REQD);
-    add_cmdline(cfg, 'i', "ipaddr", "ipaddr", "the IP address to use", "localhost", NULL, CMD_STR|CMD_ARGS);
-    add_cmdline(cfg, 0, "xtra", "xtra", "this is the extra parameter", "blart", NULL, CMD_NUM|CMD_LIST);
-
-    add_cmdline(cfg, 0, NULL, NULL, NULL, NULL, NULL, CMD_DIV);
-    add_cmdline(cfg, 'v', "verbosity", NULL, "show progress as program executes", NULL, NULL, CMD_NUM|CMD_ARGS);
-    add_cmdline(cfg, 'V', "version", NULL, "print the program version", NULL, cb_cmdline_vers, CMD_NONE);
-    add_cmdline(cfg, 'h', "help", NULL, "print this help text", NULL, cb_cmdline_help, CMD_NONE);
+    const config_load_stats_t* stats = load_configuration(cfg, argc, argv, envp);
+    //dump_hash_table(cfg->vars);
 
-    add_cmdline(cfg, 0, NULL, NULL, NULL, NULL, NULL, CMD_DIV);
-    add_cmdline(cfg, 0, NULL, "files", "list of files to be processed", NULL, NULL, CMD_REQD|CMD_LIST);
+    printf("port: %ld\n", settings.port);
+    printf("ipaddr: %s\n", settings.ipaddr);
+    printf("verbosity: %ld\n", settings.verbosity);
+    for(int i = 0; i < settings.files; i++)
+        printf("file: %s\n", get_config_array_item("files", i)->buf);
+
+    if(settings.verbosity > 0) {
+        printf("load: %lu ns (find %lu, cache %lu, scan %lu, parse %lu, cmdline %lu)\n",
+                (unsigned long)stats->total_ns, (unsigned long)stats->find_ns,
+                (unsigned long)stats->cache_ns, (unsigned long)stats->scan_ns,
+                (unsigned long)stats->parse_ns, (unsigned long)stats->cmdline_ns);
+        printf("load: %lu bytes, %lu tokens, %lu keys, %lu overrides, %lu allocations%s\n",
+                (unsigned long)stats->bytes_read, (unsigned long)stats->tokens,
+                (unsigned long)stats->keys, (unsigned long)stats->overrides,
+                (unsigned long)stats->allocs, stats->cache_hit? ", from the cache": "");
+    }
 
-    load_configuration(cfg, argc, argv, envp);
-    //dump_hash_table(cfg->vars);
     return 0;
 }
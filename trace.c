@@ -0,0 +1,125 @@
+/*
+ * Implement the phase tracing.
+ *
+ * Writers take a slot with one atomic add and fill it in, so any thread can
+ * record events without a lock. The buffer is read without stopping the
+ * writers, so it should be printed or saved when the interesting work is
+ * finished, otherwise the newest events can be incomplete.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+static trace_event_t ring[TRACE_SIZE];
+static uint64_t next_event;
+static uint32_t next_tid;
+static _Thread_local uint32_t trace_tid;
+
+/*
+ * Return the time from the monotonic clock in nanoseconds.
+ */
+uint64_t get_trace_time(void) {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Record an event. The name is not copied.
+ */
+void add_trace(char phase, const char* name, uint64_t arg) {
+
+    if(trace_tid == 0)
+        trace_tid = __atomic_add_fetch(&next_tid, 1, __ATOMIC_RELAXED);
+
+    uint64_t idx = __atomic_fetch_add(&next_event, 1, __ATOMIC_RELAXED);
+    trace_event_t* ev = &ring[idx & (TRACE_SIZE - 1)];
+
+    ev->ts = get_trace_time();
+    ev->arg = arg;
+    ev->name = name;
+    ev->tid = trace_tid;
+    ev->phase = phase;
+}
+
+/*
+ * Throw away all of the events.
+ */
+void clear_trace(void) {
+
+    __atomic_store_n(&next_event, 0, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Return the index of the oldest event that is still in the buffer and set
+ * the end to one past the newest.
+ */
+static uint64_t trace_range(uint64_t* end) {
+
+    *end = __atomic_load_n(&next_event, __ATOMIC_SEQ_CST);
+    return (*end > TRACE_SIZE)? *end - TRACE_SIZE: 0;
+}
+
+/*
+ * Print the events in the order they were recorded. The times are in
+ * microseconds from the first event that is printed.
+ */
+void dump_trace(FILE* fp) {
+
+    uint64_t end;
+    uint64_t start = trace_range(&end);
+
+    if(start > 0)
+        fprintf(fp, "trace: %lu events were overwritten\n", (unsigned long)start);
+
+    uint64_t base = ring[start & (TRACE_SIZE - 1)].ts;
+    for(uint64_t i = start; i < end; i++) {
+        trace_event_t* ev = &ring[i & (TRACE_SIZE - 1)];
+        fprintf(fp, "%12.3f  %3u  %c  %-16s %lu\n", (ev->ts - base) / 1000.0,
+                ev->tid, ev->phase, ev->name, (unsigned long)ev->arg);
+    }
+}
+
+/*
+ * Save the events as a Chrome trace event file. Begin and end events are
+ * shown as spans and instants as marks. Return non-zero if the file cannot
+ * be written.
+ */
+int save_trace(const char* fname) {
+
+    FILE* fp = fopen(fname, "w");
+    if(fp == NULL) {
+        fprintf(stderr, "WARNING: Cannot write trace file: %s: %s\n", fname, strerror(errno));
+        return 1;
+    }
+
+    uint64_t end;
+    uint64_t start = trace_range(&end);
+    int pid = getpid();
+
+    fprintf(fp, "{\"traceEvents\": [\n");
+    for(uint64_t i = start; i < end; i++) {
+        trace_event_t* ev = &ring[i & (TRACE_SIZE - 1)];
+        fprintf(fp, "  {\"name\": \"%s\", \"ph\": \"%c\", \"ts\": %.3f, \"pid\": %d, \"tid\": %u",
+                ev->name, ev->phase, ev->ts / 1000.0, pid, ev->tid);
+        if(ev->phase == 'i')
+            fprintf(fp, ", \"s\": \"t\"");
+        if(ev->phase != 'B')
+            fprintf(fp, ", \"args\": {\"n\": %lu}", (unsigned long)ev->arg);
+        fprintf(fp, "}%s\n", (i + 1 < end)? ",": "");
+    }
+    fprintf(fp, "],\n\"displayTimeUnit\": \"ms\"}\n");
+
+    int err = ferror(fp);
+    if(fclose(fp) || err) {
+        fprintf(stderr, "WARNING: Cannot write trace file: %s\n", fname);
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,46 @@
+/*
+ * Phase tracing public interface.
+ *
+ * Events are written into a fixed ring buffer with a monotonic timestamp,
+ * so recording one costs about as much as reading the clock and the
+ * timings are not thrown off by I/O. When the buffer is full the oldest
+ * events are overwritten. The buffer can be printed at any time or saved
+ * in the Chrome trace event format, which chrome://tracing and Perfetto
+ * can open.
+ *
+ * The macros are only compiled in when USE_TRACE is defined. The names
+ * must be string literals, because only the pointer is kept.
+ */
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define TRACE_SIZE (1 << 14)   // must be a power of 2
+
+typedef struct _trace_event_t_ {
+    uint64_t ts;            // nanoseconds from CLOCK_MONOTONIC
+    uint64_t arg;           // a size or a count, depending on the event
+    const char* name;
+    uint32_t tid;           // small number given to each thread
+    char phase;             // 'B' begin, 'E' end or 'i' for an instant
+} trace_event_t;
+
+#ifdef USE_TRACE
+#define TRACE_BEGIN(n) add_trace('B', (n), 0)
+#define TRACE_END(n, a) add_trace('E', (n), (a))
+#define TRACE_MARK(n, a) add_trace('i', (n), (a))
+#else
+#define TRACE_BEGIN(n) ((void)0)
+#define TRACE_END(n, a) ((void)0)
+#define TRACE_MARK(n, a) ((void)0)
+#endif
+
+uint64_t get_trace_time(void);
+void add_trace(char phase, const char* name, uint64_t arg);
+void clear_trace(void);
+void dump_trace(FILE* fp);
+int save_trace(const char* fname);
+
+#endif /* _TRACE_H_ */
@@ -0,0 +1,144 @@
+/*
+ * Implement the configuration file watcher.
+ *
+ * The directory that holds the file is watched rather than the file itself
+ * because most editors write a new file and rename it over the old one,
+ * which would silently end a watch on the original inode.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+
+#include "watch_file.h"
+#include "memory.h"
+
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO)
+
+/*
+ * Read the pending events and return non-zero if any of them are about the
+ * configuration file.
+ */
+static int read_events(config_watch_t* watch) {
+
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int changed = 0;
+
+    ssize_t len = read(watch->ifd, buf, sizeof(buf));
+    for(char* ptr = buf; len > 0 && ptr < buf + len; ) {
+        struct inotify_event* evt = (struct inotify_event*)ptr;
+        if((evt->mask & WATCH_EVENTS) && evt->len > 0 && !strcmp(evt->name, watch->base))
+            changed++;
+        ptr += sizeof(struct inotify_event) + evt->len;
+    }
+
+    return changed;
+}
+
+/*
+ * The watcher thread. Several events for the file are often delivered
+ * together, so the file is re-read once per batch.
+ */
+static void* watch_thread(void* ptr) {
+
+    config_t* cfg = (config_t*)ptr;
+    config_watch_t* watch = cfg->watch;
+    struct pollfd fds[2];
+
+    fds[0].fd = watch->ifd;
+    fds[0].events = POLLIN;
+    fds[1].fd = watch->stop[0];
+    fds[1].events = POLLIN;
+
+    while(1) {
+        if(poll(fds, 2, -1) < 0) {
+            if(errno == EINTR)
+                continue;
+            break;
+        }
+
+        if(fds[1].revents)
+            break;
+
+        if((fds[0].revents & POLLIN) && read_events(watch))
+            destroy_config_changes(update_configuration(cfg));
+    }
+
+    return NULL;
+}
+
+/*
+ * Start watching the configuration file. Return zero if the watcher was
+ * started.
+ */
+int start_config_watch(config_t* cfg) {
+
+    if(cfg->fname == NULL || cfg->watch != NULL)
+        return 1;
+
+    config_watch_t* watch = _ALLOC_DS(config_watch_t);
+    watch->dir = _DUP_STR(cfg->fname);
+    char* slash = strrchr(watch->dir, '/');
+    if(slash != NULL) {
+        // a file in the root directory keeps the slash as its directory
+        watch->base = _DUP_STR(slash + 1);
+        slash[(slash == watch->dir)? 1: 0] = '\0';
+    }
+    else {
+        watch->base = watch->dir;
+        watch->dir = _DUP_STR(".");
+    }
+
+    watch->ifd = inotify_init1(IN_CLOEXEC);
+    if(watch->ifd < 0 || inotify_add_watch(watch->ifd, watch->dir, WATCH_EVENTS) < 0 ||
+                pipe(watch->stop)) {
+        fprintf(stderr, "WARNING: Cannot watch configuration file: %s: %s\n",
+                    cfg->fname, strerror(errno));
+        if(watch->ifd >= 0)
+            close(watch->ifd);
+        _FREE(watch->dir);
+        _FREE(watch->base);
+        _FREE(watch);
+        return 1;
+    }
+
+    cfg->watch = watch;
+    if(pthread_create(&watch->thread, NULL, watch_thread, cfg)) {
+        fprintf(stderr, "WARNING: Cannot start configuration watcher\n");
+        cfg->watch = NULL;
+        close(watch->ifd);
+        close(watch->stop[0]);
+        close(watch->stop[1]);
+        _FREE(watch->dir);
+        _FREE(watch->base);
+        _FREE(watch);
+        return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Stop the watcher and wait for the thread to finish. A reload that is in
+ * progress is finished first.
+ */
+void stop_config_watch(config_t* cfg) {
+
+    config_watch_t* watch = cfg->watch;
+    if(watch == NULL)
+        return;
+
+    if(write(watch->stop[1], "", 1) == 1)
+        pthread_join(watch->thread, NULL);
+
+    close(watch->ifd);
+    close(watch->stop[0]);
+    close(watch->stop[1]);
+    _FREE(watch->dir);
+    _FREE(watch->base);
+    _FREE(watch);
+    cfg->watch = NULL;
+}
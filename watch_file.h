@@ -0,0 +1,26 @@
+/*
+ * Configuration file watcher public interface.
+ *
+ * The watcher is optional. When it is started, a background thread waits
+ * for the configuration file to change and then calls
+ * update_configuration() to apply the changes.
+ */
+#ifndef _WATCH_FILE_H_
+#define _WATCH_FILE_H_
+
+#include <pthread.h>
+
+#include "config.h"
+
+typedef struct _config_watch_t_ {
+    pthread_t thread;
+    int ifd;            // inotify descriptor
+    int stop[2];        // pipe used to wake up the thread to stop it
+    char* dir;          // directory that is watched
+    char* base;         // file name in the directory
+} config_watch_t;
+
+int start_config_watch(config_t* cfg);
+void stop_config_watch(config_t* cfg);
+
+#endif /* _WATCH_FILE_H_ */